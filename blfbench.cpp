@@ -0,0 +1,286 @@
+/*
+Measures what the log container size and compression level cost and buy:
+file bytes per frame and the latency of flushing a container, i.e.
+compressing and writing it, for every combination of the given settings.
+MB/s is the uncompressed container data logged per second.
+
+Frames come from an existing BLF file, e.g. a candump log converted with
+log2blf, or from a synthetic trace modelled on a vehicle bus: periodic
+messages on two channels with alive counters, checksums and slowly
+changing signals. They are written synchronously in batches of
+BATCH_SIZE, the flush latency is the duration of a batch that completed
+a container.
+
+    blfbench -s 4,16,64,128 -l 1,6 trace.blf
+    blfbench -s 16 -l 1,3,6,9
+
+Writing uncompressed to /dev/null leaves only the cost of encoding frames
+into containers, e.g. to see how much memory traffic the writer adds on
+top of the bytes it stores:
+
+    blfbench -l 0 -o /dev/null
+*/
+#include "blflogger.h"
+#include "blfreader.h"
+#include <algorithm>
+#include <chrono>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vector>
+
+#define BATCH_SIZE 64
+
+// Filled in by the trace hook while a batch is written
+typedef struct {
+    uint32_t containers;
+    uint64_t uncompressed;
+    uint64_t written;
+} counters_t;
+
+static void on_trace(void *ctx, blf_trace_event_t event, uint64_t a, uint64_t b) {
+    if (BLF_TRACE_CONTAINER == event) {
+        counters_t *counters = (counters_t *)ctx;
+        counters->containers++;
+        counters->uncompressed += a;
+        counters->written += b;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s container_kib,...] [-l level,...] [-n frames] [-o file.blf] [trace.blf]\n", prog);
+    fprintf(stderr, "  without a trace, -n frames (default 1000000) of a synthetic bus are used\n");
+}
+
+static std::vector<int> parse_list(const char *arg) {
+    std::vector<int> values;
+    char *end;
+    for (const char *p = arg; *p; p = *end ? end + 1 : end) {
+        values.push_back(strtol(p, &end, 10));
+    }
+    return values;
+}
+
+// Timestamps are moved off zero, which the writer takes as not set yet
+static const uint64_t TRACE_START_NS = 1000000000ull;
+
+/*
+Loads the CAN and CAN FD messages of a BLF file
+*/
+static bool load_trace(const char *path, std::vector<blf_frame_t> &frames) {
+    BLFReader reader(path);
+    if (!reader.is_open()) {
+        return false;
+    }
+    blf_object_t obj;
+    while (reader.next(&obj)) {
+        blf_frame_t f;
+        memset(&f, 0, sizeof(f));
+        f.timestamp_ns = TRACE_START_NS + blf_object_timestamp_ns(obj);
+        uint32_t arbitration_id;
+        uint8_t flags;
+        if (const can_msg_t *msg = blf_can_msg(obj)) {
+            f.channel = msg->channel;
+            arbitration_id = msg->arbitration_id;
+            flags = msg->flags;
+            f.frame.len = std::min(msg->dlc, (uint8_t)CAN_MAX_DLEN);
+            memcpy(f.frame.data, msg->data, f.frame.len);
+        } else if (const can_fd_msg_t *msg = blf_can_fd_msg(obj)) {
+            f.channel = msg->channel;
+            arbitration_id = msg->arbitration_id;
+            flags = msg->flags;
+            f.frame.flags = CANFD_FDF;
+            if (msg->fd_flags & CAN_FD_MSG_FLAG_BRS) f.frame.flags |= CANFD_BRS;
+            if (msg->fd_flags & CAN_FD_MSG_FLAG_ESI) f.frame.flags |= CANFD_ESI;
+            f.frame.len = std::min(msg->valid_data_bytes ? msg->valid_data_bytes : msg->dlc, (uint8_t)CANFD_MAX_DLEN);
+            memcpy(f.frame.data, msg->data, f.frame.len);
+        } else if (const can_fd_msg_64_t *msg = blf_can_fd_msg_64(obj)) {
+            f.channel = msg->channel;
+            arbitration_id = msg->arbitration_id;
+            flags = (msg->dir ? CAN_MSG_FLAG_TX : 0) | ((msg->flags & CAN_FD_MSG_64_FLAG_RTR) ? CAN_MSG_FLAG_RTR : 0);
+            f.frame.flags = CANFD_FDF;
+            if (msg->flags & CAN_FD_MSG_64_FLAG_BRS) f.frame.flags |= CANFD_BRS;
+            if (msg->flags & CAN_FD_MSG_64_FLAG_ESI) f.frame.flags |= CANFD_ESI;
+            f.frame.len = std::min({(size_t)msg->valid_bytes, (size_t)CANFD_MAX_DLEN, obj.size - offsetof(can_fd_msg_64_t, data)});
+            memcpy(f.frame.data, msg->data, f.frame.len);
+        } else {
+            continue;
+        }
+        f.frame.can_id = arbitration_id & CAN_EFF_MASK;
+        if (arbitration_id & CAN_MSG_EXT) {
+            f.frame.can_id |= CAN_EFF_FLAG;
+        }
+        if (flags & CAN_MSG_FLAG_RTR) {
+            f.frame.can_id |= CAN_RTR_FLAG;
+        }
+        f.flags = (flags & CAN_MSG_FLAG_TX) ? BLF_FRAME_TX : 0;
+        frames.push_back(f);
+    }
+    return true;
+}
+
+/*
+Periodic messages as seen on a vehicle bus, each sent every 10 ms to 1 s
+with some jitter
+*/
+static void synthesize_trace(size_t n, std::vector<blf_frame_t> &frames) {
+    typedef struct {
+        canid_t id;
+        uint16_t channel;
+        uint8_t len;
+        uint64_t period_ns, next_ns;
+        uint8_t counter;
+        uint16_t signal;
+        int16_t slope;
+    } message_t;
+    static const uint32_t periods_ms[] = {10, 10, 20, 20, 50, 100, 100, 200, 500, 1000};
+
+    uint32_t seed = 1;
+    auto random = [&seed]() {
+        seed = seed * 1103515245 + 12345;
+        return seed >> 16;
+    };
+    std::vector<message_t> messages(80);
+    for (size_t i = 0; i < messages.size(); i++) {
+        message_t &m = messages[i];
+        m.id = 0x100 + i * 0x13;
+        m.channel = 1 + i % 2;
+        m.len = i % 5 ? 8 : 4 + random() % 5;
+        m.period_ns = periods_ms[random() % 10] * 1000000ull;
+        m.next_ns = TRACE_START_NS + random() % m.period_ns;
+        m.counter = 0;
+        m.signal = random();
+        m.slope = random() % 7 - 3;
+    }
+
+    frames.reserve(n);
+    while (frames.size() < n) {
+        message_t &m = *std::min_element(messages.begin(), messages.end(), [](const message_t &a, const message_t &b) { return a.next_ns < b.next_ns; });
+        blf_frame_t f;
+        memset(&f, 0, sizeof(f));
+        f.timestamp_ns = m.next_ns;
+        f.channel = m.channel;
+        f.frame.can_id = m.id;
+        f.frame.len = m.len;
+        uint8_t *data = f.frame.data;
+        data[0] = m.signal;
+        data[1] = m.signal >> 8;
+        data[2] = m.id;
+        data[3] = 0xFF;
+        data[m.len - 2] = (m.counter & 0x0F) | ((m.signal >> 8) & 0x30);
+        uint8_t checksum = 0;
+        for (int i = 0; i < m.len - 1; i++) {
+            checksum ^= data[i];
+        }
+        data[m.len - 1] = checksum;
+        frames.push_back(f);
+
+        m.counter++;
+        m.signal += m.slope + (int)(random() % 3) - 1;
+        m.next_ns += m.period_ns + random() % 100000 - 50000;
+    }
+}
+
+static void run(const std::vector<blf_frame_t> &frames, const char *path, int level, int container_kib) {
+    blf_writer_config_t config;
+    config.compression_level = level;
+    config.container_size = container_kib * 1024;
+    counters_t counters = {0, 0, 0};
+    std::vector<uint64_t> flush_ns;
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        BLFWriter writer(path, config);
+        writer.set_trace_hook(on_trace, &counters);
+        for (size_t i = 0; i < frames.size(); i += BATCH_SIZE) {
+            uint32_t containers = counters.containers;
+            auto batch_start = std::chrono::steady_clock::now();
+            writer.write_batch(&frames[i], std::min((size_t)BATCH_SIZE, frames.size() - i));
+            if (counters.containers != containers) {
+                flush_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - batch_start).count());
+            }
+        }
+    }
+    double elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        perror(path);
+        return;
+    }
+    if (S_ISREG(st.st_mode)) {
+        unlink(path);
+    }
+    // container padding aside, also right when not writing to a file
+    uint64_t file_size = FILE_HEADER_SIZE + counters.containers * (sizeof(obj_header_base_t) + sizeof(log_container_t)) + counters.written;
+
+    std::sort(flush_ns.begin(), flush_ns.end());
+    double avg_us = 0, p99_us = 0, max_us = 0;
+    if (!flush_ns.empty()) {
+        for (uint64_t ns : flush_ns) {
+            avg_us += ns;
+        }
+        avg_us /= flush_ns.size() * 1000.0;
+        p99_us = flush_ns[flush_ns.size() * 99 / 100] / 1000.0;
+        max_us = flush_ns.back() / 1000.0;
+    }
+    printf("%5d %9d %10u %11.2f %6.2f %9.1f %7.1f %9.1f %9.1f %9.1f\n", level, container_kib, counters.containers,
+           (double)file_size / frames.size(), (double)counters.uncompressed / counters.written,
+           elapsed_ns / frames.size(), counters.uncompressed * 1000.0 / elapsed_ns, avg_us, p99_us, max_us);
+}
+
+int main(int argc, char **argv) {
+    std::vector<int> sizes = {4, 8, 16, 32, 64, 128};
+    std::vector<int> levels = {-1};
+    size_t n = 1000000;
+    const char *path = "blfbench.blf";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:l:n:o:h")) != -1) {
+        switch (opt) {
+        case 's':
+            sizes = parse_list(optarg);
+            break;
+        case 'l':
+            levels = parse_list(optarg);
+            break;
+        case 'n':
+            n = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<blf_frame_t> frames;
+    if (optind < argc) {
+        if (!load_trace(argv[optind], frames)) {
+            return 1;
+        }
+    } else {
+        synthesize_trace(n, frames);
+    }
+    if (frames.empty()) {
+        fprintf(stderr, "no CAN frames in trace\n");
+        return 1;
+    }
+
+    printf("%zu frames\n", frames.size());
+    printf("level container containers bytes/frame  ratio  ns/frame    MB/s  flush us    p99 us    max us\n");
+    for (int level : levels) {
+        for (int size : sizes) {
+            run(frames, path, level, size);
+        }
+    }
+    return 0;
+}
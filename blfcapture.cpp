@@ -0,0 +1,403 @@
+/*
+Captures frames from one or more SocketCAN interfaces into a BLF file.
+
+Each interface gets its own CAN_RAW socket. Frames are fetched with
+recvmmsg() in batches of up to BATCH_SIZE per syscall together with their
+SO_TIMESTAMPING timestamps and SO_RXQ_OVFL drop counters. Every poll()
+round reads one batch per ready interface, and the batches are merged by
+timestamp before they are handed to BLFWriter::write_batch(), see
+write_merged(). Hardware and software timestamps come from
+different clocks, so hardware ones are only used when every interface
+provides them, and software ones for all interfaces otherwise.
+
+Try it without hardware:
+    ip link add dev vcan0 type vcan && ip link set up vcan0
+    blfcapture -o out.blf vcan0=1 &
+    cangen -g 0 -I i -L i -f vcan0
+*/
+#include "blflogger.h"
+#include "blfrotate.h"
+#include <errno.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <algorithm>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/ethtool.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL 40
+#endif
+
+#define MAX_INTERFACES 16
+#define BATCH_SIZE 64
+
+typedef struct {
+    char name[IFNAMSIZ];
+    uint16_t channel;
+    int sock;
+    uint64_t frames;
+    uint32_t drops;
+    // last hardware timestamp, for frames without one
+    uint64_t hw_timestamp_ns;
+} interface_t;
+
+// recvmmsg bookkeeping of one interface, reused for every batch
+typedef struct {
+    struct canfd_frame frames[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    struct mmsghdr msgs[BATCH_SIZE];
+    char ctrl[BATCH_SIZE][CMSG_SPACE(3 * sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+    blf_frame_t out[BATCH_SIZE];
+    // frames in out, and the next one to write
+    int count, next;
+    // the last read filled the batch, the socket may hold more
+    bool full;
+} batch_t;
+
+static volatile sig_atomic_t running = 1;
+// Timestamp source for the whole run
+static bool hardware_timestamps = false;
+
+static void on_signal(int) {
+    running = 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-c level] [-C container_kib] [-q queue_depth] [-j threads] [-u io_uring_depth] [-d] [-s checkpoint_ms] [-T seconds] [-M megabytes] -o file.blf ifname[=channel] ...\n", prog);
+    fprintf(stderr, "  channels default to 1, 2, ... in the order the interfaces are given\n");
+    fprintf(stderr, "  -T seconds / -M megabytes rotate files, -o is then a strftime() template, %%N the file number\n");
+}
+
+static uint64_t timespec_ns(const struct timespec &ts) {
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int open_interface(interface_t *itf) {
+    int sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = if_nametoindex(itf->name);
+    if (0 == addr.can_ifindex) {
+        fprintf(stderr, "%s: no such interface\n", itf->name);
+        return -1;
+    }
+
+    int enable = 1;
+    // CAN FD frames are only delivered to sockets that ask for them
+    setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof(enable));
+    // receive all error classes as error frames
+    can_err_mask_t err_mask = CAN_ERR_MASK;
+    setsockopt(sock, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask, sizeof(err_mask));
+    if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) < 0) {
+        perror("SO_RXQ_OVFL");
+    }
+    // a deep receive queue rides out writer stalls
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(itf->name);
+        return -1;
+    }
+    itf->sock = sock;
+    return 0;
+}
+
+// Whether the driver reports raw hardware receive timestamps
+static bool has_hardware_timestamps(const interface_t *itf) {
+    struct ethtool_ts_info info;
+    memset(&info, 0, sizeof(info));
+    info.cmd = ETHTOOL_GET_TS_INFO;
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    memcpy(ifr.ifr_name, itf->name, sizeof(ifr.ifr_name));
+    ifr.ifr_data = (char *)&info;
+    const uint32_t required = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    return 0 == ioctl(itf->sock, SIOCETHTOOL, &ifr) && required == (info.so_timestamping & required);
+}
+
+static void enable_timestamping(const interface_t *itf) {
+    int timestamping = hardware_timestamps ? SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE
+                                           : SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(itf->sock, SOL_SOCKET, SO_TIMESTAMPING, &timestamping, sizeof(timestamping)) < 0) {
+        perror("SO_TIMESTAMPING");
+    }
+}
+
+/*
+Reads up to BATCH_SIZE frames from one interface into its batch, which
+must have been written out. Returns the number of frames read, or -1 on
+error.
+*/
+static int read_batch(interface_t *itf, batch_t *batch) {
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->ctrl[i]);
+        batch->msgs[i].msg_hdr.msg_flags = 0;
+    }
+    batch->count = batch->next = 0;
+    batch->full = false;
+
+    int n = recvmmsg(itf->sock, batch->msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        return (EAGAIN == errno || EINTR == errno) ? 0 : -1;
+    }
+    batch->full = BATCH_SIZE == n;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+        unsigned int len = batch->msgs[i].msg_len;
+        if (len != CAN_MTU && len != CANFD_MTU) {
+            continue;
+        }
+
+        blf_frame_t *f = &batch->out[count++];
+        f->frame = batch->frames[i];
+        f->frame.flags = CANFD_MTU == len ? (f->frame.flags | CANFD_FDF) : 0;
+        f->channel = itf->channel;
+        // local echo of our own transmissions
+        f->flags = (hdr->msg_flags & MSG_DONTROUTE) ? BLF_FRAME_TX : 0;
+        // local echoes carry no hardware timestamp with some drivers, they
+        // keep to the interface's hardware clock with its last timestamp
+        f->timestamp_ns = hardware_timestamps ? itf->hw_timestamp_ns : timespec_ns(now);
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+            if (SOL_SOCKET != cmsg->cmsg_level) {
+                continue;
+            }
+            if (SO_TIMESTAMPING == cmsg->cmsg_type) {
+                // [0] software, [2] raw hardware timestamp
+                struct timespec ts[3];
+                memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+                uint64_t ns = timespec_ns(ts[hardware_timestamps ? 2 : 0]);
+                if (ns) {
+                    f->timestamp_ns = ns;
+                    if (hardware_timestamps) {
+                        itf->hw_timestamp_ns = ns;
+                    }
+                }
+            } else if (SO_RXQ_OVFL == cmsg->cmsg_type) {
+                uint32_t drops;
+                memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                if (drops != itf->drops) {
+                    fprintf(stderr, "%s: %u frames dropped by the kernel\n", itf->name, drops - itf->drops);
+                    itf->drops = drops;
+                }
+            }
+        }
+    }
+
+    batch->count = count;
+    itf->frames += count;
+    return count;
+}
+
+/*
+Writes the frames read so far in timestamp order, each socket delivers
+its own frames in order. An interface whose last read filled its batch
+may have older frames queued than the newest ones read from the others,
+so nothing newer than its last frame is written before it is read again.
+*/
+template <typename Writer>
+static void write_merged(Writer &writer, batch_t *batches, int count, bool all) {
+    uint64_t horizon = UINT64_MAX;
+    for (int i = 0; i < count && !all; i++) {
+        if (batches[i].full && batches[i].count) {
+            horizon = std::min(horizon, batches[i].out[batches[i].count - 1].timestamp_ns);
+        }
+    }
+
+    blf_frame_t out[BATCH_SIZE];
+    int n = 0;
+    for (;;) {
+        batch_t *oldest = NULL;
+        for (int i = 0; i < count; i++) {
+            batch_t *b = &batches[i];
+            if (b->next < b->count && (!oldest || b->out[b->next].timestamp_ns < oldest->out[oldest->next].timestamp_ns)) {
+                oldest = b;
+            }
+        }
+        if (!oldest || oldest->out[oldest->next].timestamp_ns > horizon) {
+            break;
+        }
+        out[n++] = oldest->out[oldest->next++];
+        if (BATCH_SIZE == n) {
+            writer.write_batch(out, n);
+            n = 0;
+        }
+    }
+    if (n) {
+        writer.write_batch(out, n);
+    }
+}
+
+template <typename Writer>
+static void capture(Writer &writer, interface_t *interfaces, struct pollfd *fds, int count, batch_t *batches) {
+    while (running) {
+        // a full batch is read again right away, whether or not more is queued
+        bool full = false;
+        for (int i = 0; i < count; i++) {
+            full = full || (batches[i].full && batches[i].next == batches[i].count);
+        }
+        int ready = poll(fds, count, full ? 0 : 500);
+        if (ready < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        // one batch per interface and round, once its last one is written
+        for (int i = 0; i < count; i++) {
+            batch_t *b = &batches[i];
+            if (b->next < b->count || !((fds[i].revents & POLLIN) || b->full)) {
+                continue;
+            }
+            if (read_batch(&interfaces[i], b) < 0) {
+                perror(interfaces[i].name);
+                running = 0;
+            }
+        }
+        write_merged(writer, batches, count, false);
+    }
+    write_merged(writer, batches, count, true);
+}
+
+int main(int argc, char **argv) {
+    blf_rotate_config_t rotate;
+    blf_writer_config_t &config = rotate.writer;
+    config.queue_depth = 4;
+    const char *output = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:C:q:j:u:ds:T:M:o:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            config.compression_level = atoi(optarg);
+            break;
+        case 'C':
+            config.container_size = atoi(optarg) * 1024;
+            break;
+        case 'q':
+            config.queue_depth = atoi(optarg);
+            break;
+        case 'j':
+            config.compression_threads = atoi(optarg);
+            break;
+        case 'u':
+            config.io_uring_depth = atoi(optarg);
+            break;
+        case 'd':
+            config.direct_io = true;
+            break;
+        case 's':
+            config.checkpoint_ms = atoi(optarg);
+            break;
+        case 'T':
+            rotate.max_seconds = atoi(optarg);
+            break;
+        case 'M':
+            rotate.max_bytes = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int count = argc - optind;
+    if (NULL == output || count < 1 || count > MAX_INTERFACES) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    interface_t interfaces[MAX_INTERFACES];
+    struct pollfd fds[MAX_INTERFACES];
+    memset(interfaces, 0, sizeof(interfaces));
+    for (int i = 0; i < count; i++) {
+        interface_t *itf = &interfaces[i];
+        const char *arg = argv[optind + i];
+        const char *eq = strchr(arg, '=');
+        size_t name_len = eq ? (size_t)(eq - arg) : strlen(arg);
+        if (name_len >= IFNAMSIZ) {
+            fprintf(stderr, "%s: interface name too long\n", arg);
+            return 1;
+        }
+        memcpy(itf->name, arg, name_len);
+        itf->channel = eq ? atoi(eq + 1) : i + 1;
+        if (open_interface(itf) < 0) {
+            return 1;
+        }
+        fds[i].fd = itf->sock;
+        fds[i].events = POLLIN;
+    }
+    hardware_timestamps = true;
+    for (int i = 0; i < count; i++) {
+        hardware_timestamps = hardware_timestamps && has_hardware_timestamps(&interfaces[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        enable_timestamping(&interfaces[i]);
+    }
+    fprintf(stderr, "using %s timestamps\n", hardware_timestamps ? "hardware" : "software");
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    batch_t *batches = (batch_t *)calloc(count, sizeof(batch_t));
+    for (int b = 0; b < count; b++) {
+        batch_t *batch = &batches[b];
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            batch->iov[i].iov_base = &batch->frames[i];
+            batch->iov[i].iov_len = sizeof(batch->frames[i]);
+            batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+            batch->msgs[i].msg_hdr.msg_iovlen = 1;
+            batch->msgs[i].msg_hdr.msg_control = batch->ctrl[i];
+        }
+    }
+
+    if (rotate.max_seconds || rotate.max_bytes) {
+        rotate.path_template = output;
+        BLFRotatingWriter writer(rotate);
+        capture(writer, interfaces, fds, count, batches);
+        fprintf(stderr, "%u files written\n", writer.files());
+    } else {
+        BLFWriter writer(output, config);
+        capture(writer, interfaces, fds, count, batches);
+
+        blf_writer_stats_t stats = writer.stats();
+        fprintf(stderr, "%u containers queued, %u writer stalls (%llu us)\n", stats.containers_queued, stats.stalls, (unsigned long long)(stats.stall_ns / 1000));
+        if (stats.checkpoints) {
+            fprintf(stderr, "%u checkpoints, %llu us on average, %llu us max\n", stats.checkpoints, (unsigned long long)(stats.checkpoint_ns / stats.checkpoints / 1000), (unsigned long long)(stats.max_checkpoint_ns / 1000));
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        fprintf(stderr, "%s (channel %u): %llu frames, %u dropped\n", interfaces[i].name, interfaces[i].channel, (unsigned long long)interfaces[i].frames, interfaces[i].drops);
+    }
+    free(batches);
+    return 0;
+}
@@ -1,98 +1,337 @@
 #include "blflogger.h"
+#include <stddef.h>
 #include <time.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <algorithm>
+#include <chrono>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 #include "miniz/miniz.h"
 
-BLFWriter::BLFWriter(const char *filepath, int8_t compression_level) : 
+#ifndef BLF_NO_TRACE
+#define BLF_TRACE(event, a, b)                    \
+    do {                                          \
+        if (_trace_fn) {                          \
+            _trace_fn(_trace_ctx, (event), (a), (b)); \
+        }                                         \
+    } while (0)
+#else
+#define BLF_TRACE(event, a, b) ((void)0)
+#endif
+
+#ifdef __linux__
+// O_DIRECT offset, size and buffer alignment, and the size of the chunks written
+constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+constexpr size_t DIRECT_IO_CHUNK = 64 * 1024;
+
+static inline constexpr size_t align_up(size_t size) {
+    return (size + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1);
+}
+
+static uint8_t *aligned_alloc_pool(size_t count, size_t size) {
+    void *pool;
+    return 0 == posix_memalign(&pool, DIRECT_IO_ALIGNMENT, count * size) ? (uint8_t *)pool : NULL;
+}
+#endif
+
+static int open_output(const char *filepath, bool direct_io) {
+    int flags = O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC;
+#ifdef __linux__
+    if (direct_io) {
+        int fd = open(filepath, flags | O_DIRECT, 0666);
+        if (fd >= 0 || EINVAL != errno) {
+            return fd;
+        }
+        fprintf(stderr, "%s: O_DIRECT not supported, writing through the page cache\n", filepath);
+    }
+#endif
+    return open(filepath, flags, 0666);
+}
+
+// fdatasync() skips the metadata flush where the platform has it
+static int sync_data(int fd) {
+#ifdef __linux__
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+static blf_writer_config_t make_config(int8_t compression_level) {
+    blf_writer_config_t config;
+    config.compression_level = compression_level;
+    return config;
+}
+
+static int make_comp_flags(const blf_writer_config_t &config) {
+    int flags = tdefl_create_comp_flags_from_zip_params(config.compression_level, MZ_DEFAULT_WINDOW_BITS, config.compression_strategy);
+    if (config.max_probes) {
+        flags = (flags & ~TDEFL_MAX_PROBES_MASK) | (config.max_probes & TDEFL_MAX_PROBES_MASK);
+    }
+    return flags;
+}
+
+// Drops the options that need allocations or threads
+static blf_writer_config_t static_config(const blf_writer_config_t &config, const blf_writer_storage_t &storage) {
+    blf_writer_config_t result = config;
+    result.queue_depth = 0;
+    result.write_index = false;
+    result.io_uring_depth = 0;
+    result.direct_io = false;
+    if (NULL == storage.compressor) {
+        result.compression_level = 0;
+    }
+    return result;
+}
+
+BLFWriter::BLFWriter(const char *filepath, const blf_writer_config_t &config) : BLFWriter(filepath, config, NULL) {}
+
+BLFWriter::BLFWriter(const char *filepath, const blf_writer_config_t &config, const blf_writer_storage_t &storage) : BLFWriter(filepath, static_config(config, storage), &storage) {}
+
+BLFWriter::BLFWriter(const char *filepath, const blf_writer_config_t &config, const blf_writer_storage_t *storage) : 
                                             //  cache_size(0),
                                              _uncompressed_size(FILE_HEADER_SIZE),
                                             //  start_timestamp(0),
                                             //  stop_timestamp(0),
                                              _count_of_objects(0),
-                                             _fd(fopen(filepath, "w+b")),
+                                             _fd(open_output(filepath, config.direct_io)),
+                                             _file_size(0),
+                                             _file_size_written(0),
+                                             _preallocate(config.preallocate),
+                                             _allocated(0),
+                                             _ring(NULL),
+                                             _direct(NULL),
+                                             _direct_size(0),
+                                             _container_size(storage ? storage->container_size : std::max(config.container_size, (uint32_t)MIN_CONTAINER_SIZE)),
+                                             _static_storage(NULL != storage),
+                                             _buffer_size(0),
+                                             _buffer(NULL),
+                                             _reserved_size(0),
                                              _start_timestamp(0),
                                              _stop_timestamp(0),
-                                             _compression_level(compression_level),
-                                             _pCmpSize(_compression_level ? compressBound(sizeof(_buffer)) : 0),
-                                             _pCmp(_compression_level ? (unsigned char *)malloc(_pCmpSize) : NULL) {
-    for (auto i = 0; i < FILE_HEADER_SIZE; i++) {
-        fwrite("\0", 1, 1, _fd);
+                                             _compression_level(config.compression_level),
+                                             _fd_message_64(config.fd_message_64),
+                                             _pCmpSize(!_compression_level ? 0 : storage ? storage->out_size : compressBound(_container_size)),
+                                             _comp_flags(make_comp_flags(config)),
+                                             _storage_compressor({storage ? storage->compressor : NULL, storage ? storage->out : NULL}),
+                                             _compressor(!_compression_level || config.queue_depth ? NULL : storage ? &_storage_compressor : _compressor_create()),
+                                             _index_fd(NULL),
+                                             _index_count(0),
+                                             _written_objects(0),
+                                             _written_max_timestamp(0),
+                                             _checkpoint_containers(config.checkpoint_containers),
+                                             _checkpoint_ms(config.checkpoint_ms),
+                                             _containers_since_checkpoint(0),
+                                             _last_checkpoint(std::chrono::steady_clock::now()),
+                                             _checkpoint_due(false),
+                                             _queue_depth(config.queue_depth),
+                                             _pool(storage ? NULL : (uint8_t *)malloc((_queue_depth + 1) * _container_size)),
+                                             _free(storage ? NULL : (uint8_t **)malloc((_queue_depth + 1) * sizeof(uint8_t *))),
+                                             _free_count(0),
+                                             _full(storage ? NULL : (container_t *)malloc((_queue_depth + 1) * sizeof(container_t))),
+                                             _full_head(0),
+                                             _full_count(0),
+                                             _in_flight(0),
+                                             _next_seq(0),
+                                             _next_write_seq(0),
+                                             _stopping(false),
+                                             _trace_fn(NULL),
+                                             _trace_ctx(NULL) {
+    memset(&_stats, 0, sizeof(_stats));
+    memset(&_meta, 0, sizeof(_meta));
+    if (storage) {
+        _buffer = storage->buffer;
+    } else {
+        for (auto i = 0; i <= _queue_depth; i++) {
+            _free[_free_count++] = _pool + i * _container_size;
+        }
+        _buffer = _free[--_free_count];
+    }
+
+    if (_fd < 0) {
+        perror(filepath);
+    } else {
+        // largest single write: one container, or a chunk of staged containers
+        size_t write_size = sizeof(obj_header_base_t) + sizeof(log_container_t) + std::max((size_t)_container_size, _pCmpSize) + 3;
+#ifdef __linux__
+        int flags = fcntl(_fd, F_GETFL);
+        if (flags & O_DIRECT) {
+            _direct = aligned_alloc_pool(1, DIRECT_IO_CHUNK + align_up(write_size));
+            if (_direct) {
+                write_size = DIRECT_IO_CHUNK + align_up(write_size);
+            } else {
+                // unstaged writes would fail with EINVAL on every container
+                fprintf(stderr, "O_DIRECT staging buffer: out of memory, writing through the page cache\n");
+                if (fcntl(_fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+                    perror("fcntl");
+                }
+            }
+        }
+        if (config.io_uring_depth) {
+            _ring = _ring_create(config.io_uring_depth, write_size);
+        }
+#endif
+        // placeholder, the header is rewritten on close
+        static const uint8_t zeros[FILE_HEADER_SIZE] = {0};
+        struct iovec iov = {(void *)zeros, sizeof(zeros)};
+        _write_file(&iov, 1);
+    }
+
+    // without an index, one left from an earlier file of the same name
+    // is not touched, BLFReader ignores it as it does not match the file
+    if (_fd >= 0 && config.write_index) {
+        char index_path[PATH_MAX];
+        snprintf(index_path, sizeof(index_path), "%s.idx", filepath);
+        _index_fd = fopen(index_path, "w+b");
+        if (NULL == _index_fd) {
+            perror(index_path);
+        } else {
+            _write_index_header(0, 0, 0);
+        }
+    }
+
+    for (auto i = 0; _queue_depth && i < std::max(config.compression_threads, (uint8_t)1); i++) {
+        _workers.emplace_back(&BLFWriter::_worker_main, this);
+    }
+    if (_checkpoint_ms && !storage && _fd >= 0) {
+        _timer = std::thread(&BLFWriter::_timer_main, this);
     }
 }
 
+BLFWriter::BLFWriter(const char *filepath, int8_t compression_level) : BLFWriter(filepath, make_config(compression_level)) {}
+
 BLFWriter::BLFWriter(const char *filepath) : BLFWriter(filepath, -1) {}
 
 BLFWriter::~BLFWriter() {
+    stop();
+    if (!_static_storage) {
+        _compressor_destroy(_compressor);
+        free(_pool);
+        free(_free);
+        free(_full);
+    }
+}
+
+void BLFWriter::sync() {
     _flush();
-    _write_header();
-    free(_pCmp);
-    fclose(_fd);
+    if (_queue_depth) {
+        // every buffer but the one being filled back in the pool means
+        // all queued containers are written
+        std::unique_lock<std::mutex> lock(_mutex);
+        _free_cv.wait(lock, [this] { return _free_count == _queue_depth; });
+    }
+    _checkpoint();
 }
 
+void BLFWriter::stop() {
+    if (_stopping) {
+        return;
+    }
+    _flush();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _full_cv.notify_all();
+    _timer_cv.notify_all();
+    for (auto &worker : _workers) {
+        worker.join();
+    }
+    if (_timer.joinable()) {
+        _timer.join();
+    }
+#ifdef __linux__
+    // waits for the writes still in flight
+    _ring_destroy(_ring);
+    _ring = NULL;
+    _direct_finish();
+#endif
+    _write_header(_file_size, _count_of_objects, _stop_timestamp);
+    if (_index_fd) {
+        _write_index_header(_file_size, _count_of_objects, _index_count);
+        fclose(_index_fd);
+        _index_fd = NULL;
+    }
+    if (_fd >= 0) {
+        if (_allocated > _file_size && ftruncate(_fd, _file_size) < 0) {
+            perror("ftruncate");
+        }
+        close(_fd);
+        _fd = -1;
+    }
+}
 
-void BLFWriter::on_message_received(uint64_t timestamp_ns, uint32_t arbitration_id, uint8_t *data, uint8_t dlc) {
-    on_message_received(timestamp_ns, arbitration_id, data, dlc, 1, false, false, false, false, true, false, false);
+void BLFWriter::set_trace_hook(blf_trace_fn fn, void *ctx) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _trace_fn = fn;
+    _trace_ctx = ctx;
 }
 
-void BLFWriter::on_message_received(uint64_t timestamp_ns, uint32_t arbitration_id, uint8_t *data, uint8_t dlc, uint16_t channel, bool is_extended_id, bool is_remote_frame, bool is_error_frame, bool is_fd, bool is_rx, bool bitrate_switch, bool error_state_indicator) {
-    if (is_error_frame) {
-        can_error_ext_t msg;
-        memset(&msg, 0, sizeof(msg));
-        printf("error frame: 0x%x\n", arbitration_id);
-        msg.channel = channel;
-        msg.dlc = dlc;
-        msg._reserved0 = 0xFF;
-        msg.frame_length = 1;
-        msg.arbitration_id = arbitration_id;
-        memmove(msg.data, data, std::min(dlc, (uint8_t)sizeof(msg.data)));
-        _add_object(CAN_ERROR_EXT, &msg, sizeof(msg), timestamp_ns);
-    } else if (is_fd) {
-        can_fd_msg_t msg;
-        memset(&msg, 0, sizeof(msg));
-        assert(dlc <= sizeof(msg.data));
-        if (!is_rx) msg.flags |= CAN_MSG_FLAG_TX;
-        if (is_remote_frame) msg.flags |= CAN_MSG_FLAG_RTR; 
-        msg.arbitration_id = arbitration_id;
-        msg.channel = channel;
-        msg.dlc = dlc;
-        memmove(msg.data, data, dlc);
-        _add_object(CAN_FD_MESSAGE, &msg, sizeof(msg), timestamp_ns);
-    } else {
-        can_msg_t msg;
-        memset(&msg, 0, sizeof(msg));
-        assert(dlc <= sizeof(msg.data));
-        msg.arbitration_id = arbitration_id;
-        msg.dlc = dlc;
-        msg.flags = 0;
-        if (!is_rx) msg.flags |= CAN_MSG_FLAG_TX;
-        if (is_remote_frame) msg.flags |= CAN_MSG_FLAG_RTR;
-        msg.channel = channel; 
-        memmove(msg.data, data, dlc);
-        _add_object(CAN_MESSAGE, &msg, sizeof(can_msg_t), timestamp_ns);
+void blf_trace_stdout(void *, blf_trace_event_t event, uint64_t a, uint64_t b) {
+    switch (event) {
+    case BLF_TRACE_OBJECT:
+        printf("object %llu, %llu bytes\n", (unsigned long long)a, (unsigned long long)b);
+        break;
+    case BLF_TRACE_ERROR_FRAME:
+        printf("error frame: 0x%llx\n", (unsigned long long)a);
+        break;
+    case BLF_TRACE_CONTAINER:
+        printf("container %llu bytes, %llu written\n", (unsigned long long)a, (unsigned long long)b);
+        break;
+    case BLF_TRACE_COMPRESS_FAILED:
+        printf("compress of %llu bytes failed: %lld\n", (unsigned long long)a, (long long)b);
+        break;
     }
 }
 
+blf_writer_stats_t BLFWriter::stats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+
+
+constexpr uint16_t OBJ_HEADER_SIZE = sizeof(obj_header_base_t) + sizeof(obj_header_v1_t);
+
+// CAN_FD_MESSAGE_64 objects are the only ones not padded to 4 bytes
+static inline constexpr uint32_t object_padding(blf_objtype_t type, uint32_t obj_size) {
+    return CAN_FD_MESSAGE_64 == type ? 0 : obj_size % 4;
+}
+
+static inline constexpr uint32_t padded_object_size(blf_objtype_t type, size_t size) {
+    return OBJ_HEADER_SIZE + size + object_padding(type, OBJ_HEADER_SIZE + size);
+}
+
+static inline constexpr uint32_t message_object_size(bool is_error_frame, bool is_fd, bool fd_message_64, uint8_t len) {
+    return is_error_frame ? padded_object_size(CAN_ERROR_EXT, sizeof(can_error_ext_t))
+           : !is_fd       ? padded_object_size(CAN_MESSAGE, sizeof(can_msg_t))
+           : fd_message_64 ? padded_object_size(CAN_FD_MESSAGE_64, offsetof(can_fd_msg_64_t, data) + std::min(len, (uint8_t)64))
+                          : padded_object_size(CAN_FD_MESSAGE, sizeof(can_fd_msg_t));
+}
+
+// Largest object on_message_received and write_batch can produce
+static constexpr uint32_t MAX_MESSAGE_OBJECT_SIZE = std::max({message_object_size(true, false, false, 0),
+                                                              message_object_size(false, true, false, 0),
+                                                              message_object_size(false, true, true, 64)});
+
 /*
-Takes absolute timestamp in nanoseconds
+Writes both object headers and the trailing padding of an object at obj
+and returns a pointer to its payload
 */
-void BLFWriter::_add_object(blf_objtype_t type, void *data, size_t size, uint64_t timestamp_ns) {
-    constexpr uint16_t header_size = sizeof(obj_header_base_t) + sizeof(obj_header_v1_t);
-    uint32_t obj_size = header_size + size;
-    auto offset = 0;
-
-    if (0 == _start_timestamp) {
-        _start_timestamp = timestamp_ns;
-    }
-    _stop_timestamp = timestamp_ns;
-    uint64_t timedelta = timestamp_ns - _start_timestamp;
+static inline uint8_t *write_object_header(uint8_t *obj, blf_objtype_t type, size_t size, uint64_t timedelta) {
+    uint32_t obj_size = OBJ_HEADER_SIZE + size;
 
     obj_header_base_t base_header = {
         .signature = {'L', 'O', 'B', 'J'},
-        .header_size = header_size,
+        .header_size = OBJ_HEADER_SIZE,
         .header_version = 1,
         .object_size = obj_size,
         .object_type = type,
@@ -105,55 +344,399 @@ void BLFWriter::_add_object(blf_objtype_t type, void *data, size_t size, uint64_
         .timestamp =  timedelta,
     };
 
-    _buffer_append(&base_header, sizeof(base_header));
-    _buffer_append(&obj_header, sizeof(obj_header));
-    _buffer_append(data, size);
-    auto padding_size = (sizeof(base_header) + sizeof(obj_header) + size) % 4;
-    while (padding_size--) {
-        _buffer_append("\0", 1);
+    // the container offset is not necessarily aligned, memcpy compiles to plain stores
+    memcpy(obj, &base_header, sizeof(base_header));
+    memcpy(obj + sizeof(base_header), &obj_header, sizeof(obj_header));
+    memset(obj + obj_size, 0, object_padding(type, obj_size));
+    return obj + OBJ_HEADER_SIZE;
+}
+
+void BLFWriter::on_message_received(uint64_t timestamp_ns, uint32_t arbitration_id, uint8_t *data, uint8_t dlc) {
+    on_message_received(timestamp_ns, arbitration_id, data, dlc, 1, false, false, false, false, true, false, false);
+}
+
+void BLFWriter::on_message_received(uint64_t timestamp_ns, uint32_t arbitration_id, uint8_t *data, uint8_t dlc, uint16_t channel, bool is_extended_id, bool is_remote_frame, bool is_error_frame, bool is_fd, bool is_rx, bool bitrate_switch, bool error_state_indicator) {
+    if (0 == _start_timestamp) {
+        _start_timestamp = timestamp_ns;
+    }
+    _stop_timestamp = std::max(_stop_timestamp, timestamp_ns);
+
+    uint8_t *obj = _reserve(message_object_size(is_error_frame, is_fd, _fd_message_64, dlc));
+    _reserved_size = _encode_message(obj, timestamp_ns, arbitration_id, data, dlc, channel, is_extended_id, is_remote_frame, is_error_frame, is_fd, is_rx, bitrate_switch, error_state_indicator);
+    _commit_object();
+}
+
+#ifdef __linux__
+void BLFWriter::write_batch(const blf_frame_t *frames, size_t n) {
+    if (0 == n) {
+        return;
+    }
+    if (0 == _start_timestamp) {
+        _start_timestamp = frames[0].timestamp_ns;
+    }
+
+    uint64_t stop_timestamp = _stop_timestamp;
+    size_t i = 0;
+    while (i < n) {
+        // Every frame of a run is guaranteed to fit, so the run is encoded
+        // without checking for a full container after each object
+        size_t run = std::min(n - i, (size_t)(_container_size - _buffer_size) / MAX_MESSAGE_OBJECT_SIZE);
+        if (0 == run) {
+            // close to the end of the container, check this frame's exact size
+            const blf_frame_t &f = frames[i++];
+            uint8_t *obj = _reserve(message_object_size(f.frame.can_id & CAN_ERR_FLAG, f.frame.flags & CANFD_FDF, _fd_message_64, f.frame.len));
+            _reserved_size = _encode_frame(obj, f);
+            _commit_object();
+            stop_timestamp = std::max(stop_timestamp, f.timestamp_ns);
+            continue;
+        }
+        uint8_t *obj = _buffer + _buffer_size;
+        for (size_t end = i + run; i < end; i++) {
+            uint32_t size = _encode_frame(obj, frames[i]);
+            obj += size;
+            _count_of_objects++;
+            BLF_TRACE(BLF_TRACE_OBJECT, _count_of_objects, size);
+            stop_timestamp = std::max(stop_timestamp, frames[i].timestamp_ns);
+        }
+        _commit(obj - (_buffer + _buffer_size));
     }
+    // batches drained from several producers are not sorted
+    _stop_timestamp = stop_timestamp;
+}
+
+uint32_t BLFWriter::_encode_frame(uint8_t *obj, const blf_frame_t &f) {
+    canid_t can_id = f.frame.can_id;
+    bool is_error_frame = can_id & CAN_ERR_FLAG;
+    bool is_fd = f.frame.flags & CANFD_FDF;
+    uint8_t len = std::min(f.frame.len, (uint8_t)(is_fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN));
+    uint32_t arbitration_id = can_id & (is_error_frame ? CAN_ERR_MASK : (can_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+    return _encode_message(obj, f.timestamp_ns, arbitration_id, f.frame.data, len, f.channel, can_id & CAN_EFF_FLAG, can_id & CAN_RTR_FLAG, is_error_frame, is_fd, !(f.flags & BLF_FRAME_TX), f.frame.flags & CANFD_BRS, f.frame.flags & CANFD_ESI);
+}
+#endif
+
+/*
+Encodes one CAN, CAN FD or error frame object at obj, writing every
+field exactly once. Returns the object size including padding.
+*/
+uint32_t BLFWriter::_encode_message(uint8_t *obj, uint64_t timestamp_ns, uint32_t arbitration_id, const uint8_t *data, uint8_t dlc, uint16_t channel, bool is_extended_id, bool is_remote_frame, bool is_error_frame, bool is_fd, bool is_rx, bool bitrate_switch, bool error_state_indicator) {
+    uint64_t timedelta = _timedelta(timestamp_ns);
+    _track_object(timedelta);
+    if (!is_error_frame) {
+        blf_id_filter_add(_meta.id_filter, arbitration_id);
+    }
+    if (is_extended_id && !is_error_frame) {
+        arbitration_id |= CAN_MSG_EXT;
+    }
+
+    if (is_error_frame) {
+        BLF_TRACE(BLF_TRACE_ERROR_FRAME, arbitration_id, dlc);
+        can_error_ext_t *msg = (can_error_ext_t *)write_object_header(obj, CAN_ERROR_EXT, sizeof(can_error_ext_t), timedelta);
+        auto len = std::min(dlc, (uint8_t)sizeof(msg->data));
+        msg->channel = channel;
+        msg->length = 0;
+        msg->flags = 0;
+        msg->ecc = 0;
+        msg->position = 0;
+        msg->dlc = dlc;
+        msg->_reserved0 = 0xFF;
+        msg->frame_length = 1;
+        msg->arbitration_id = arbitration_id;
+        msg->flags_ext = 0;
+        memset(msg->_reserved1, 0, sizeof(msg->_reserved1));
+        memcpy(msg->data, data, len);
+        memset(msg->data + len, 0, sizeof(msg->data) - len);
+        return padded_object_size(CAN_ERROR_EXT, sizeof(can_error_ext_t));
+    } else if (is_fd && _fd_message_64) {
+        uint32_t size = offsetof(can_fd_msg_64_t, data) + dlc;
+        can_fd_msg_64_t *msg = (can_fd_msg_64_t *)write_object_header(obj, CAN_FD_MESSAGE_64, size, timedelta);
+        assert(dlc <= sizeof(msg->data));
+        msg->channel = channel;
+        msg->dlc = blf_len2dlc(dlc);
+        msg->valid_bytes = dlc;
+        msg->tx_count = 0;
+        msg->arbitration_id = arbitration_id;
+        msg->frame_length = 0;
+        msg->flags = CAN_FD_MSG_64_FLAG_EDL;
+        if (is_remote_frame) msg->flags |= CAN_FD_MSG_64_FLAG_RTR;
+        if (bitrate_switch) msg->flags |= CAN_FD_MSG_64_FLAG_BRS;
+        if (error_state_indicator) msg->flags |= CAN_FD_MSG_64_FLAG_ESI;
+        msg->btr_cfg_arb = 0;
+        msg->btr_cfg_data = 0;
+        msg->time_offset_brs_ns = 0;
+        msg->time_offset_crc_del_ns = 0;
+        msg->bit_count = 0;
+        msg->dir = is_rx ? 0 : 1;
+        msg->ext_data_offset = 0;
+        msg->crc = 0;
+        memcpy(msg->data, data, dlc);
+        return padded_object_size(CAN_FD_MESSAGE_64, size);
+    } else if (is_fd) {
+        can_fd_msg_t *msg = (can_fd_msg_t *)write_object_header(obj, CAN_FD_MESSAGE, sizeof(can_fd_msg_t), timedelta);
+        assert(dlc <= sizeof(msg->data));
+        msg->channel = channel;
+        msg->flags = 0;
+        if (!is_rx) msg->flags |= CAN_MSG_FLAG_TX;
+        if (is_remote_frame) msg->flags |= CAN_MSG_FLAG_RTR; 
+        msg->dlc = blf_len2dlc(dlc);
+        msg->arbitration_id = arbitration_id;
+        msg->frame_length = 0;
+        msg->bit_count = 0;
+        msg->fd_flags = CAN_FD_MSG_FLAG_EDL;
+        if (bitrate_switch) msg->fd_flags |= CAN_FD_MSG_FLAG_BRS;
+        if (error_state_indicator) msg->fd_flags |= CAN_FD_MSG_FLAG_ESI;
+        msg->valid_data_bytes = dlc;
+        memset(msg->_reserved, 0, sizeof(msg->_reserved));
+        memcpy(msg->data, data, dlc);
+        memset(msg->data + dlc, 0, sizeof(msg->data) - dlc);
+        return padded_object_size(CAN_FD_MESSAGE, sizeof(can_fd_msg_t));
+    } else {
+        can_msg_t *msg = (can_msg_t *)write_object_header(obj, CAN_MESSAGE, sizeof(can_msg_t), timedelta);
+        assert(dlc <= sizeof(msg->data));
+        msg->channel = channel; 
+        msg->flags = 0;
+        if (!is_rx) msg->flags |= CAN_MSG_FLAG_TX;
+        if (is_remote_frame) msg->flags |= CAN_MSG_FLAG_RTR;
+        msg->dlc = dlc;
+        msg->arbitration_id = arbitration_id;
+        memcpy(msg->data, data, dlc);
+        memset(msg->data + dlc, 0, sizeof(msg->data) - dlc);
+        return padded_object_size(CAN_MESSAGE, sizeof(can_msg_t));
+    }
+}
+
+/*
+Takes absolute timestamp in nanoseconds
+*/
+void BLFWriter::_add_object(blf_objtype_t type, void *data, size_t size, uint64_t timestamp_ns) {
+    memcpy(_reserve_object(type, size, timestamp_ns), data, size);
+    _commit_object();
+}
+
+/*
+Reserves room for a whole object (headers, payload and padding) in the
+current container, flushing it first if the object does not fit, and
+writes the object headers in place. The returned payload pointer must be
+filled in completely before the object is published with
+_commit_object(), container buffers are reused without being cleared.
+Takes absolute timestamp in nanoseconds
+*/
+void *BLFWriter::_reserve_object(blf_objtype_t type, size_t size, uint64_t timestamp_ns) {
+    uint8_t *obj = _reserve(padded_object_size(type, size));
+
+    if (0 == _start_timestamp) {
+        _start_timestamp = timestamp_ns;
+    }
+    _stop_timestamp = std::max(_stop_timestamp, timestamp_ns);
+
+    _reserved_size = padded_object_size(type, size);
+    _track_object(_timedelta(timestamp_ns));
+    return write_object_header(obj, type, size, _timedelta(timestamp_ns));
+}
+
+// Frames older than the first one logged, e.g. late from another source,
+// are stamped with the start of the log rather than wrapping around
+inline uint64_t BLFWriter::_timedelta(uint64_t timestamp_ns) const {
+    return timestamp_ns > _start_timestamp ? timestamp_ns - _start_timestamp : 0;
+}
+
+inline void BLFWriter::_track_object(uint64_t timedelta) {
+    if (0 == _meta.objects++) {
+        _meta.min_timestamp = _meta.max_timestamp = timedelta;
+        memset(_meta.id_filter, 0, sizeof(_meta.id_filter));
+    } else {
+        _meta.min_timestamp = std::min(_meta.min_timestamp, timedelta);
+        _meta.max_timestamp = std::max(_meta.max_timestamp, timedelta);
+    }
+}
+
+void BLFWriter::_commit_object() {
+    _commit(_reserved_size);
     _count_of_objects++;
-    printf("%d, %d,  %d, %d\n", _count_of_objects, size, padding_size, offset);
+    BLF_TRACE(BLF_TRACE_OBJECT, _count_of_objects, _reserved_size);
 }
 
-void BLFWriter::_buffer_append(const void *data, size_t size) {
-    assert(size < sizeof(_buffer));
+/*
+Returns a pointer to size contiguous bytes at the end of the current
+container, flushing it first if there is not enough room left
+*/
+uint8_t *BLFWriter::_reserve(size_t size) {
+    assert(size < _container_size);
 
-    if (size > sizeof(_buffer) - _buffer_size) {
+    if (size > _container_size - _buffer_size) {
         _flush();
     }
-    memmove(_buffer + _buffer_size, data, size);
+    return _buffer + _buffer_size;
+}
+
+void BLFWriter::_commit(size_t size) {
     _buffer_size += size;
+    if (_checkpoint_due.load(std::memory_order_relaxed)) {
+        _flush();
+    }
 }
 
 /**
- * compresses and writes data in the buffer to file
+ * hands the buffer over to the writer thread, or compresses and writes it
+ * directly when running synchronously
  */
 void BLFWriter::_flush() {
-    if (NULL == _fd || 0 == _buffer_size) {
+    if (0 == _buffer_size) {
+        return;
+    }
+    if (_fd < 0) {
+        // not open or already stopped, the container is dropped to make room
+        _buffer_size = 0;
+        _meta.objects = 0;
         return;
     }
 
-    uint16_t compression_method = _compression_level ? ZLIB_DEFLATE : NO_COMPRESSION;
+    // closed early by the checkpoint timer
+    bool checkpoint = _checkpoint_due.exchange(false, std::memory_order_relaxed);
+    if (!_queue_depth) {
+        const uint8_t *data;
+        unsigned long data_size;
+        uint16_t compression_method = _compress(_buffer, _buffer_size, _compressor, &data, &data_size);
+        _write_container(data, data_size, compression_method, _buffer_size, _meta, checkpoint);
+        _buffer_size = 0;
+        _meta.objects = 0;
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (0 == _free_count) {
+        auto wait_start = std::chrono::steady_clock::now();
+        _free_cv.wait(lock, [this] { return _free_count > 0; });
+        _stats.stalls++;
+        _stats.stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - wait_start).count();
+    }
+
+    _full[(_full_head + _full_count) % (_queue_depth + 1)] = {_buffer, _buffer_size, _next_seq++, _meta, checkpoint};
+    _full_count++;
+    _stats.containers_queued++;
+    _stats.max_queue_depth = std::max(_stats.max_queue_depth, _full_count + _in_flight);
+    _full_cv.notify_one();
+
+    _buffer = _free[--_free_count];
+    _buffer_size = 0;
+    _meta.objects = 0;
+}
+
+/**
+ * Containers are taken from _full in sequence order and compressed
+ * concurrently by all workers, then written strictly in that same order.
+ */
+void BLFWriter::_worker_main() {
+    compressor_t *compressor = _compression_level ? _compressor_create() : NULL;
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+        _full_cv.wait(lock, [this] { return _full_count > 0 || _stopping; });
+        if (0 == _full_count) {
+            break;
+        }
+        container_t container = _full[_full_head];
+        _full_head = (_full_head + 1) % (_queue_depth + 1);
+        _full_count--;
+        _in_flight++;
+
+        lock.unlock();
+        const uint8_t *data;
+        unsigned long data_size;
+        uint16_t compression_method = _compress(container.data, container.size, compressor, &data, &data_size);
+        lock.lock();
+
+        _write_cv.wait(lock, [&] { return _next_write_seq == container.seq; });
+        lock.unlock();
+        _write_container(data, data_size, compression_method, container.size, container.meta, container.checkpoint);
+        lock.lock();
+        _next_write_seq++;
+        _write_cv.notify_all();
+
+        _in_flight--;
+        _free[_free_count++] = container.data;
+        _free_cv.notify_one();
+    }
+    lock.unlock();
+    _compressor_destroy(compressor);
+}
+
+/*
+Raises _checkpoint_due once checkpoint_ms have passed since the last
+checkpoint. The container being filled belongs to the ingest thread, so
+it is only closed there, at the next object.
+*/
+void BLFWriter::_timer_main() {
+    const auto interval = std::chrono::milliseconds(_checkpoint_ms);
+    auto fired = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stopping) {
+        auto deadline = std::max(_last_checkpoint, fired) + interval;
+        _timer_cv.wait_until(lock, deadline, [this] { return _stopping; });
+        auto now = std::chrono::steady_clock::now();
+        if (!_stopping && now >= std::max(_last_checkpoint, fired) + interval) {
+            _checkpoint_due.store(true, std::memory_order_relaxed);
+            fired = now;
+        }
+    }
+}
 
-    unsigned char *data = NULL;
-    unsigned long data_size = 0;
+// Allocated here rather than with tdefl_compressor_alloc(), which is
+// missing when miniz is built with MINIZ_NO_MALLOC. NULL if out of memory,
+// containers are then stored uncompressed.
+BLFWriter::compressor_t *BLFWriter::_compressor_create() {
+    compressor_t *compressor = (compressor_t *)calloc(1, sizeof(compressor_t));
+    if (compressor) {
+        compressor->state = malloc(sizeof(tdefl_compressor));
+        compressor->out = (uint8_t *)malloc(_pCmpSize);
+    }
+    if (!compressor || !compressor->state || !compressor->out) {
+        fprintf(stderr, "deflate state: out of memory, storing containers uncompressed\n");
+        _compressor_destroy(compressor);
+        return NULL;
+    }
+    return compressor;
+}
 
-    if (compression_method) {
-        data_size = _pCmpSize;
-        printf("pCmpSize: %d\n", _pCmpSize);
-        auto cmp_status = compress(_pCmp, &data_size, (const unsigned char *)_buffer, _buffer_size);
-        if (cmp_status  != Z_OK) {
-            printf("%p, %d\n", _pCmp, _pCmpSize);
-            fprintf(stderr, "compress failed\n");
+void BLFWriter::_compressor_destroy(compressor_t *compressor) {
+    if (NULL == compressor) {
+        return;
+    }
+    free(compressor->state);
+    free(compressor->out);
+    free(compressor);
+}
+
+/**
+ * deflates buffer with the compressor's persistent state and points data
+ * at the container payload. Returns the compression method to record in
+ * the container header. Stores the buffer as is without a compressor.
+ */
+uint16_t BLFWriter::_compress(const uint8_t *buffer, uint32_t buffer_size, compressor_t *compressor, const uint8_t **data, unsigned long *data_size) {
+    if (_compression_level && compressor) {
+        size_t in_size = buffer_size;
+        size_t out_size = _pCmpSize;
+        // tdefl_init only resets the state, the compressor itself is reused
+        tdefl_compressor *state = (tdefl_compressor *)compressor->state;
+        tdefl_init(state, NULL, NULL, _comp_flags);
+        auto cmp_status = tdefl_compress(state, buffer, &in_size, compressor->out, &out_size, TDEFL_FINISH);
+        if (cmp_status == TDEFL_STATUS_DONE) {
+            *data = compressor->out;
+            *data_size = out_size;
+            return ZLIB_DEFLATE;
         }
-        data = _pCmp;
-    } else {
-        data = _buffer;
-        data_size = _buffer_size;
+        // stored uncompressed instead, reported through the trace hook only
+        BLF_TRACE(BLF_TRACE_COMPRESS_FAILED, buffer_size, cmp_status);
     }
+    *data = buffer;
+    *data_size = buffer_size;
+    return NO_COMPRESSION;
+}
 
+/**
+ * writes one container to file
+ */
+void BLFWriter::_write_container(const uint8_t *data, unsigned long data_size, uint16_t compression_method, uint32_t buffer_size, const container_meta_t &meta, bool checkpoint) {
     assert(data);
+    uint64_t offset = _file_size;
     auto obj_size =  sizeof(obj_header_base_t) + sizeof(log_container_t) + data_size;
 
     obj_header_base_t base_header = {
@@ -167,29 +750,446 @@ void BLFWriter::_flush() {
     log_container_t container = {
         .compression_method = compression_method,
         ._pad0 = {0},
-        .size_uncompressed = _buffer_size,
+        .size_uncompressed = buffer_size,
         ._pad1 = {0},
     };
 
-    fwrite(&base_header, sizeof(obj_header_base_t), 1, _fd);
-    fwrite(&container, sizeof(log_container_t), 1, _fd);
-    fwrite(data, data_size, 1, _fd);
-    // write padding bytes
-    auto padding_size =  obj_size % 4;
-    printf("writing %d padding bytes\n", padding_size);
-    while (padding_size--) {
-        printf("%d\n", ftell(_fd));
-        fwrite("\00", 1, 1, _fd);
+    // headers, payload and padding in a single syscall
+    static const uint8_t padding[4] = {0};
+    struct iovec iov[] = {
+        {&base_header, sizeof(base_header)},
+        {&container, sizeof(container)},
+        {(void *)data, data_size},
+        {(void *)padding, obj_size % 4},
+    };
+    _write_file(iov, sizeof(iov) / sizeof(iov[0]));
+    BLF_TRACE(BLF_TRACE_CONTAINER, buffer_size, data_size);
+
+    if (_index_fd) {
+        blf_index_entry_t entry = {
+            .offset = offset,
+            .object_size = (uint32_t)obj_size,
+            .uncompressed_size = buffer_size,
+            .count_of_objects = meta.objects,
+            ._reserved = 0,
+            .min_timestamp = meta.min_timestamp,
+            .max_timestamp = meta.max_timestamp,
+            .id_filter = {0},
+        };
+        memcpy(entry.id_filter, meta.id_filter, sizeof(entry.id_filter));
+        fwrite(&entry, sizeof(entry), 1, _index_fd);
+        _index_count++;
     }
-    printf("%d\n", ftell(_fd));
 
     _uncompressed_size += sizeof(obj_header_base_t);
     _uncompressed_size += sizeof(log_container_t);
-    _uncompressed_size += _buffer_size;
-    _buffer_size = 0;
-    memset(_buffer, 0, MAX_CONTAINER_SIZE);
+    _uncompressed_size += buffer_size;
+
+    _file_size_written.store(_file_size, std::memory_order_relaxed);
+    _written_objects += meta.objects;
+    _written_max_timestamp = std::max(_written_max_timestamp, meta.max_timestamp);
+    _containers_since_checkpoint++;
+    if (checkpoint || (_checkpoint_containers && _containers_since_checkpoint >= _checkpoint_containers) ||
+        (_checkpoint_ms && std::chrono::steady_clock::now() - _last_checkpoint >= std::chrono::milliseconds(_checkpoint_ms))) {
+        _checkpoint();
+    }
+}
+
+/*
+Makes everything written so far durable and only then points the file
+header at it. Runs with the write turn held, or with the workers idle.
+*/
+void BLFWriter::_checkpoint() {
+    if (_fd < 0) {
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+
+#ifdef __linux__
+    if (_direct && _direct_size) {
+        // the staged tail padded to a whole block, overwritten by the
+        // next chunk and truncated on close
+        size_t padded = align_up(_direct_size);
+        memset(_direct + _direct_size, 0, padded - _direct_size);
+        _write_at(_direct, padded, _file_size - _direct_size);
+        _allocated = std::max(_allocated, _file_size - _direct_size + padded);
+    }
+    _ring_drain();
+#endif
+    if (sync_data(_fd) < 0) {
+        perror("fdatasync");
+    }
+    _write_header(_file_size, _written_objects, _start_timestamp + _written_max_timestamp);
+#ifdef __linux__
+    _ring_drain();
+#endif
+    if (sync_data(_fd) < 0) {
+        perror("fdatasync");
+    }
+    if (_index_fd) {
+        _write_index_header(_file_size, _written_objects, 0);
+        fflush(_index_fd);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    _containers_since_checkpoint = 0;
+    // read by the timer thread
+    std::lock_guard<std::mutex> lock(_mutex);
+    _last_checkpoint = end;
+    _stats.checkpoints++;
+    _stats.checkpoint_ns += elapsed;
+    _stats.max_checkpoint_ns = std::max(_stats.max_checkpoint_ns, elapsed);
 }
 
+/*
+Appends the buffers at _file_size, retrying short writes. With io_uring
+the write is only queued.
+*/
+void BLFWriter::_write_file(struct iovec *iov, int iovcnt) {
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    _preallocate_for(size);
+
+#ifdef __linux__
+    if (_direct) {
+        _direct_append(iov, iovcnt, size);
+        return;
+    }
+    if (_ring) {
+        _ring_write(iov, iovcnt, size, _file_size);
+        _file_size += size;
+        return;
+    }
+#endif
+
+    while (size) {
+        ssize_t written = writev(_fd, iov, iovcnt);
+        if (written < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            perror("writev");
+            return;
+        }
+        _file_size += written;
+        size -= written;
+        while (iovcnt && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+/*
+Grows the preallocated region to cover size more bytes at _file_size
+*/
+void BLFWriter::_preallocate_for(size_t size) {
+#ifdef __linux__
+    if (_preallocate && _file_size + size > _allocated) {
+        uint64_t length = (_file_size + size - _allocated + _preallocate - 1) / _preallocate * _preallocate;
+        // KEEP_SIZE leaves the file size alone, a crash does not expose unwritten blocks
+        if (0 == fallocate(_fd, FALLOC_FL_KEEP_SIZE, _allocated, length)) {
+            _allocated += length;
+        } else {
+            _allocated = UINT64_MAX;
+        }
+    }
+#endif
+}
+
+/*
+Writes size bytes at offset, queued with io_uring if enabled
+*/
+void BLFWriter::_write_at(const uint8_t *data, size_t size, uint64_t offset) {
+#ifdef __linux__
+    if (_ring) {
+        struct iovec iov = {(void *)data, size};
+        _ring_write(&iov, 1, size, offset);
+        return;
+    }
+#endif
+    while (size) {
+        ssize_t written = pwrite(_fd, data, size, offset);
+        if (written < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            perror("pwrite");
+            return;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+#ifdef __linux__
+/*
+Stages the buffers and writes out the aligned part of the staging buffer
+once it holds a full chunk, keeping the unaligned rest for the next one
+*/
+void BLFWriter::_direct_append(const struct iovec *iov, int iovcnt, size_t size) {
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(_direct + _direct_size, iov[i].iov_base, iov[i].iov_len);
+        _direct_size += iov[i].iov_len;
+    }
+    _file_size += size;
+    if (_direct_size < DIRECT_IO_CHUNK) {
+        return;
+    }
+    size_t aligned = _direct_size & ~(DIRECT_IO_ALIGNMENT - 1);
+    _write_at(_direct, aligned, _file_size - _direct_size);
+    memcpy(_direct, _direct + aligned, _direct_size - aligned);
+    _direct_size -= aligned;
+}
+
+/*
+O_DIRECT cannot write the final partial block or patch the header in
+place, the file is switched back to buffered I/O for both
+*/
+void BLFWriter::_direct_finish() {
+    if (NULL == _direct) {
+        return;
+    }
+    if (fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) & ~O_DIRECT) < 0) {
+        perror("fcntl");
+    }
+    _write_at(_direct, _direct_size, _file_size - _direct_size);
+    free(_direct);
+    _direct = NULL;
+    _direct_size = 0;
+}
+
+/*
+Minimal io_uring on top of the raw syscalls. Submissions and completions
+are only touched by whoever holds the write turn, or by the destructor
+once the workers are gone, so the ring itself needs no locking.
+*/
+struct BLFWriter::io_ring_t {
+    int fd;
+    unsigned depth;
+    uint8_t *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    // Pool of staging buffers, registered with the kernel if possible.
+    // A buffer is busy from submission until its completion is reaped.
+    uint8_t *buffers;
+    size_t buffer_size;
+    bool registered;
+    uint32_t *free_buffers;
+    uint32_t free_count;
+    // queued in the SQ but not yet accepted by the kernel
+    unsigned unsubmitted;
+    uint64_t *offsets;
+    uint32_t *sizes;
+};
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+BLFWriter::io_ring_t *BLFWriter::_ring_create(unsigned depth, size_t buffer_size) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0) {
+        perror("io_uring_setup, writing synchronously");
+        return NULL;
+    }
+
+    io_ring_t *ring = (io_ring_t *)calloc(1, sizeof(io_ring_t));
+    struct iovec *iov = (struct iovec *)malloc(depth * sizeof(struct iovec));
+    if (ring) {
+        // aligned so the ring can also carry O_DIRECT writes
+        ring->buffer_size = align_up(buffer_size);
+        ring->buffers = aligned_alloc_pool(depth, ring->buffer_size);
+        ring->free_buffers = (uint32_t *)malloc(depth * sizeof(uint32_t));
+        ring->offsets = (uint64_t *)malloc(depth * sizeof(uint64_t));
+        ring->sizes = (uint32_t *)malloc(depth * sizeof(uint32_t));
+    }
+    if (!ring || !iov || !ring->buffers || !ring->free_buffers || !ring->offsets || !ring->sizes) {
+        fprintf(stderr, "io_uring buffers: out of memory, writing synchronously\n");
+        if (ring) {
+            free(ring->buffers);
+            free(ring->free_buffers);
+            free(ring->offsets);
+            free(ring->sizes);
+            free(ring);
+        }
+        free(iov);
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->depth = depth;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_map_size = ring->cq_map_size = std::max(ring->sq_map_size, ring->cq_map_size);
+    }
+    ring->sq_map = (uint8_t *)mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map;
+    if (MAP_FAILED != ring->sq_map && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_map = (uint8_t *)mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (MAP_FAILED == ring->sq_map || MAP_FAILED == ring->cq_map || MAP_FAILED == ring->sqes) {
+        perror("io_uring mmap, writing synchronously");
+        if (MAP_FAILED != ring->sq_map) {
+            munmap(ring->sq_map, ring->sq_map_size);
+        }
+        if (MAP_FAILED != ring->cq_map && ring->cq_map != ring->sq_map) {
+            munmap(ring->cq_map, ring->cq_map_size);
+        }
+        if (MAP_FAILED != ring->sqes) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        close(fd);
+        free(ring->buffers);
+        free(ring->free_buffers);
+        free(ring->offsets);
+        free(ring->sizes);
+        free(ring);
+        free(iov);
+        return NULL;
+    }
+    ring->sq_head = (unsigned *)(ring->sq_map + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(ring->sq_map + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(ring->sq_map + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(ring->sq_map + params.sq_off.array);
+    ring->cq_head = (unsigned *)(ring->cq_map + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(ring->cq_map + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(ring->cq_map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ring->cq_map + params.cq_off.cqes);
+
+    for (unsigned i = 0; i < depth; i++) {
+        ring->free_buffers[ring->free_count++] = i;
+        iov[i].iov_base = ring->buffers + i * ring->buffer_size;
+        iov[i].iov_len = ring->buffer_size;
+    }
+    // registration pins the pages once instead of on every write, it may
+    // exceed RLIMIT_MEMLOCK on older kernels
+    ring->registered = 0 == syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, depth);
+    free(iov);
+    return ring;
+}
+
+void BLFWriter::_ring_destroy(io_ring_t *ring) {
+    if (NULL == ring) {
+        return;
+    }
+    _ring_drain();
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    free(ring->buffers);
+    free(ring->free_buffers);
+    free(ring->offsets);
+    free(ring->sizes);
+    free(ring);
+}
+
+/*
+Stages the buffers into a free pool buffer and queues one write at
+offset, waiting for completions only when the pool is exhausted
+*/
+void BLFWriter::_ring_write(const struct iovec *iov, int iovcnt, size_t size, uint64_t offset) {
+    io_ring_t *ring = _ring;
+    assert(size <= ring->buffer_size);
+    _ring_reap(false);
+    while (0 == ring->free_count) {
+        _ring_reap(true);
+    }
+    uint32_t index = ring->free_buffers[--ring->free_count];
+    uint8_t *buffer = ring->buffers + index * ring->buffer_size;
+    for (int i = 0, pos = 0; i < iovcnt; pos += iov[i++].iov_len) {
+        memcpy(buffer + pos, iov[i].iov_base, iov[i].iov_len);
+    }
+    ring->offsets[index] = offset;
+    ring->sizes[index] = size;
+
+    // the SQ has as many entries as there are buffers, a slot is always free
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ring->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = _fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->buf_index = ring->registered ? index : 0;
+    sqe->user_data = index;
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+    int submitted = io_uring_enter(ring->fd, ring->unsubmitted, 0, 0);
+    if (submitted > 0) {
+        ring->unsubmitted -= submitted;
+    }
+}
+
+// Waits for all writes in flight
+void BLFWriter::_ring_drain() {
+    while (_ring && _ring->free_count < _ring->depth) {
+        _ring_reap(true);
+    }
+}
+
+/*
+Returns the buffers of completed writes to the pool. A short or failed
+write is finished synchronously so the file never has holes.
+*/
+void BLFWriter::_ring_reap(bool wait) {
+    io_ring_t *ring = _ring;
+    if (wait) {
+        int submitted = io_uring_enter(ring->fd, ring->unsubmitted, 1, IORING_ENTER_GETEVENTS);
+        if (submitted > 0) {
+            ring->unsubmitted -= submitted;
+        } else if (submitted < 0 && EINTR != errno && EAGAIN != errno) {
+            perror("io_uring_enter");
+        }
+    }
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uint32_t index = cqe->user_data;
+        uint32_t done = cqe->res < 0 ? 0 : cqe->res;
+        if (cqe->res < 0 && -EAGAIN != cqe->res) {
+            fprintf(stderr, "io_uring write: %s\n", strerror(-cqe->res));
+        }
+        const uint8_t *buffer = ring->buffers + index * ring->buffer_size;
+        while (done < ring->sizes[index]) {
+            ssize_t written = pwrite(_fd, buffer + done, ring->sizes[index] - done, ring->offsets[index] + done);
+            if (written < 0 && EINTR != errno) {
+                perror("pwrite");
+                break;
+            }
+            done += written > 0 ? written : 0;
+        }
+        ring->free_buffers[ring->free_count++] = index;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
 systemtime_t BLFWriter::timestamp_to_systemtime(uint64_t timestamp_ns) {
     systemtime_t systemtime;
     memset(&systemtime, 0, sizeof(systemtime));
@@ -214,8 +1214,24 @@ systemtime_t BLFWriter::timestamp_to_systemtime(uint64_t timestamp_ns) {
     return systemtime;
 }
 
-void BLFWriter::_write_header() {
-    uint64_t file_size = ftell(_fd);
+void BLFWriter::_write_index_header(uint64_t file_size, uint32_t count_of_objects, uint32_t count_of_entries) {
+    blf_index_header_t header = {
+        .signature = {'B', 'L', 'F', 'I'},
+        .header_size = sizeof(blf_index_header_t),
+        .entry_size = sizeof(blf_index_entry_t),
+        .count_of_entries = count_of_entries,
+        .count_of_objects = count_of_objects,
+        .file_size = file_size,
+    };
+    fseek(_index_fd, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, _index_fd);
+    fseek(_index_fd, 0, SEEK_END);
+}
+
+void BLFWriter::_write_header(uint64_t file_size, uint32_t count_of_objects, uint64_t stop_timestamp) {
+    if (_fd < 0) {
+        return;
+    }
 
     file_header_t header = {
         .signature = {'L', 'O', 'G', 'G'},
@@ -230,26 +1246,35 @@ void BLFWriter::_write_header() {
         .bin_log_patch = 1,
         .file_size = file_size,
         .uncompressed_size = _uncompressed_size,
-        .count_of_objects = _count_of_objects,
+        .count_of_objects = count_of_objects,
         .count_of_objects_read = 0,
         .time_start = timestamp_to_systemtime(_start_timestamp),
-        .time_stop = timestamp_to_systemtime(_stop_timestamp),
+        .time_stop = timestamp_to_systemtime(stop_timestamp),
     };
 
-    fseek(_fd, 0, SEEK_SET);
-
-    fwrite(&header, sizeof(file_header_t), 1, _fd);
-
-    fseek(_fd, 0, SEEK_END);
+#ifdef __linux__
+    if (_direct) {
+        // O_DIRECT only writes whole blocks, patch the header into the
+        // first one wherever it currently is
+        if (_file_size == _direct_size) {
+            memcpy(_direct, &header, sizeof(header));
+            size_t padded = align_up(_direct_size);
+            memset(_direct + _direct_size, 0, padded - _direct_size);
+            _write_at(_direct, padded, 0);
+            return;
+        }
+        uint8_t *block = aligned_alloc_pool(1, DIRECT_IO_ALIGNMENT);
+        if (block && pread(_fd, block, DIRECT_IO_ALIGNMENT, 0) == DIRECT_IO_ALIGNMENT) {
+            memcpy(block, &header, sizeof(header));
+            _write_at(block, DIRECT_IO_ALIGNMENT, 0);
+        } else {
+            perror("pread");
+        }
+        free(block);
+        return;
+    }
+#endif
+    if (pwrite(_fd, &header, sizeof(file_header_t), 0) != sizeof(file_header_t)) {
+        perror("pwrite");
+    }
 }
-
-// void BLFWriter::sync() {
-//     _flush();
-//     _write_header();
-//     ::fsync(fileno(_fd));
-// }
-
-// void BLFWriter::stop() {
-//     sync();
-//     fclose(_fd);
-// }
\ No newline at end of file
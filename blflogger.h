@@ -4,6 +4,16 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/can.h>
+#endif
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #define APPLICATION_ID 0xf00
 
@@ -96,16 +106,53 @@ typedef struct {
 typedef struct {
     uint16_t channel;
     uint8_t flags;
+    // DLC code, 9-15 for 12-64 bytes
     uint8_t dlc;
     uint32_t arbitration_id;
     uint32_t frame_length;
     uint8_t bit_count;
+#define CAN_FD_MSG_FLAG_EDL 0x01
+#define CAN_FD_MSG_FLAG_BRS 0x02
+#define CAN_FD_MSG_FLAG_ESI 0x04
     uint8_t fd_flags;
     uint8_t valid_data_bytes;
     uint8_t _reserved[5];
     uint8_t data[64];
 } __attribute__((packed)) can_fd_msg_t;
 
+// Only the first valid_bytes of data are stored, and the object is not
+// padded to 4 bytes like the others
+typedef struct {
+    uint8_t channel;
+    uint8_t dlc;
+    uint8_t valid_bytes;
+    uint8_t tx_count;
+    uint32_t arbitration_id;
+    uint32_t frame_length;
+#define CAN_FD_MSG_64_FLAG_RTR 0x0010
+#define CAN_FD_MSG_64_FLAG_EDL 0x1000
+#define CAN_FD_MSG_64_FLAG_BRS 0x2000
+#define CAN_FD_MSG_64_FLAG_ESI 0x4000
+    uint32_t flags;
+    uint32_t btr_cfg_arb;
+    uint32_t btr_cfg_data;
+    uint32_t time_offset_brs_ns;
+    uint32_t time_offset_crc_del_ns;
+    uint16_t bit_count;
+    // 0 rx, 1 tx
+    uint8_t dir;
+    // offset of extended data from the start of the object, 0 if none
+    uint8_t ext_data_offset;
+    uint32_t crc;
+    uint8_t data[64];
+} __attribute__((packed)) can_fd_msg_64_t;
+
+// DLC code of a CAN FD payload of len bytes, rounded up to the next valid length
+static inline uint8_t blf_len2dlc(uint8_t len) {
+    static const uint8_t dlc[] = {9, 10, 11, 12, 13, 13, 14, 14, 14, 14};
+    return len <= 8 ? len : len > 48 ? 15 : dlc[(len - 9) / 4];
+}
+
 typedef struct {
     uint16_t channel;
     uint16_t length;
@@ -132,34 +179,319 @@ typedef struct {
     frame_direction_e direction;
 } frameobject_t;
 
-// Max log container size of uncompressed data
+/*
+Sidecar index: a blf_index_header_t followed by one entry per
+LOG_CONTAINER in file order
+*/
+typedef struct {
+    char signature[4];
+    uint32_t header_size;
+    uint32_t entry_size;
+    // 0 if the writer did not shut down cleanly, count the entries instead
+    uint32_t count_of_entries;
+    // file_size and count_of_objects of the BLF file header as last written
+    // along with the index, an index not matching its file is ignored
+    uint32_t count_of_objects;
+    uint64_t file_size;
+} __attribute__((packed)) blf_index_header_t;
+
+#define BLF_ID_FILTER_BITS 1024
+
+typedef struct {
+    uint64_t offset;
+    uint32_t object_size;
+    uint32_t uncompressed_size;
+    uint32_t count_of_objects;
+    uint32_t _reserved;
+    // object timestamps in ns relative to the start of the log
+    uint64_t min_timestamp;
+    uint64_t max_timestamp;
+    // Bloom filter of the arbitration ids (without CAN_MSG_EXT) of the CAN
+    // and CAN FD messages in the container, see blf_id_filter_add()
+    uint8_t id_filter[BLF_ID_FILTER_BITS / 8];
+} __attribute__((packed)) blf_index_entry_t;
+
+// Three bit positions per id taken from one multiplicative hash
+static inline uint64_t blf_id_filter_hash(uint32_t id) {
+    return id * 0x9E3779B97F4A7C15ull;
+}
+
+static inline void blf_id_filter_add(uint8_t *filter, uint32_t id) {
+    uint64_t h = blf_id_filter_hash(id);
+    for (int i = 0; i < 3; i++, h <<= 10) {
+        uint32_t bit = h >> 54;
+        filter[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+// false if id is definitely not in filter
+static inline bool blf_id_filter_test(const uint8_t *filter, uint32_t id) {
+    uint64_t h = blf_id_filter_hash(id);
+    for (int i = 0; i < 3; i++, h <<= 10) {
+        uint32_t bit = h >> 54;
+        if (!(filter[bit / 8] & (1 << (bit % 8)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef __linux__
+typedef struct {
+    uint64_t timestamp_ns;
+    uint16_t channel;
+#define BLF_FRAME_TX 0x0001
+    uint16_t flags;
+    // CANFD_FDF in frame.flags marks a CAN FD frame, CAN_ERR_FLAG an error frame
+    struct canfd_frame frame;
+} blf_frame_t;
+#endif
+
+// Default log container size of uncompressed data
 constexpr auto MAX_CONTAINER_SIZE = 16 * 1024;
+// Smallest container_size accepted, anything less is rounded up
+constexpr auto MIN_CONTAINER_SIZE = 1024;
 constexpr auto FILE_HEADER_SIZE = 144;
 
+// Fastest deflate: greedy parsing with a single probe into a 4K entry
+// hash, which miniz runs through its specialized tdefl_compress_fast()
+// path on CPUs with unaligned loads. A few times the throughput of the
+// default level for files about 10% larger. Strategies other than default
+// and fixed, or a max_probes override other than 1, take it off that path.
+constexpr int8_t BLF_COMPRESSION_FAST = 1;
+
+typedef struct {
+    // 0 disables compression, -1 selects the miniz default level (6),
+    // up to 9 for the best ratio, see also BLF_COMPRESSION_FAST
+    int8_t compression_level = -1;
+    // Log CAN FD frames as CAN_FD_MESSAGE_64 objects, sized to their
+    // data, rather than as CAN_FD_MESSAGE with a fixed 64 byte payload
+    bool fd_message_64 = true;
+    // Uncompressed bytes per log container. Small containers reach the
+    // file sooner and lose less in a crash, large ones compress better and
+    // carry fewer container headers. blfbench measures the trade-off.
+    uint32_t container_size = MAX_CONTAINER_SIZE;
+    // Full containers allowed in flight to the background writer thread.
+    // 0 compresses and writes inline from the thread logging the frames.
+    uint8_t queue_depth = 0;
+    // Threads compressing queued containers in parallel. Containers are
+    // still written to the file in the order they were filled.
+    uint8_t compression_threads = 1;
+    // MZ_DEFAULT_STRATEGY, MZ_FILTERED, MZ_HUFFMAN_ONLY, MZ_RLE or MZ_FIXED from miniz.h
+    int8_t compression_strategy = 0;
+    // Dictionary probes per match search (1-4095), 0 keeps the level's default
+    uint16_t max_probes = 0;
+    // Write a container index to <filepath>.idx for fast time range and
+    // arbitration id queries. Without it, an index left from an earlier
+    // file of the same name stays and is ignored by BLFReader.
+    bool write_index = false;
+    // Reserve disk space in chunks of this many bytes ahead of the write
+    // position (fallocate, Linux only), 0 disables. Unused space is
+    // released on close.
+    uint32_t preallocate = 0;
+    // Containers handed to the kernel with io_uring without waiting for
+    // the write to complete, 0 writes synchronously. Falls back to
+    // synchronous writes where io_uring is unavailable. Linux only.
+    uint8_t io_uring_depth = 0;
+    // Bypass the page cache with O_DIRECT. Containers are staged in 4 KiB
+    // aligned buffers and written in aligned chunks, the unaligned tail
+    // and the header go through the page cache on close. Linux only.
+    bool direct_io = false;
+    // Checkpoint after this many containers or once this many ms have
+    // passed since the last one; 0 disables either. A checkpoint makes the
+    // data written so far durable with fdatasync and then updates the file
+    // header, so a crash loses at most what came after it. Once
+    // checkpoint_ms have passed, a timer thread has the container being
+    // filled closed at the next object and checkpointed once written, so
+    // a slow bus is covered too. On a bus that goes quiet altogether, what
+    // came since the last checkpoint waits for the next frame, sync() or
+    // stop(). BLFStaticWriter starts no timer and checks checkpoint_ms
+    // only when a container is written.
+    uint32_t checkpoint_containers = 0;
+    uint32_t checkpoint_ms = 0;
+} blf_writer_config_t;
+
+// Memory for a writer that never allocates, see BLFStaticWriter in
+// blfstatic.h. Must outlive the writer.
+typedef struct {
+    // Container being filled, container_size bytes
+    uint8_t *buffer;
+    uint32_t container_size;
+    // tdefl_compressor state and the deflate output buffer, out_size should
+    // be at least mz_compressBound(container_size). A NULL compressor
+    // writes uncompressed containers.
+    void *compressor;
+    uint8_t *out;
+    size_t out_size;
+} blf_writer_storage_t;
+
+typedef struct {
+    uint32_t containers_queued;
+    // High-water mark of containers waiting for or being written by the writer thread
+    uint32_t max_queue_depth;
+    // Number of times the ingest thread had to wait for a free container
+    uint32_t stalls;
+    uint64_t stall_ns;
+    // Time spent in checkpoints, mostly waiting for fdatasync
+    uint32_t checkpoints;
+    uint64_t checkpoint_ns;
+    uint64_t max_checkpoint_ns;
+} blf_writer_stats_t;
+
+typedef enum {
+    BLF_TRACE_OBJECT,          // a: object count, b: object size including padding
+    BLF_TRACE_ERROR_FRAME,     // a: arbitration id, b: dlc
+    BLF_TRACE_CONTAINER,       // a: uncompressed size, b: size written to file
+    BLF_TRACE_COMPRESS_FAILED, // a: uncompressed size, b: tdefl status
+} blf_trace_event_t;
+
+// Diagnostics hook. Container events are raised from the writer threads
+// when running asynchronously. Build with BLF_NO_TRACE to compile it out.
+typedef void (*blf_trace_fn)(void *ctx, blf_trace_event_t event, uint64_t a, uint64_t b);
+
+// Ready-made hook printing every event to stdout
+void blf_trace_stdout(void *ctx, blf_trace_event_t event, uint64_t a, uint64_t b);
+
 class BLFWriter {
   public:
     BLFWriter(const char *filepath);
     BLFWriter(const char *filepath, int8_t compression_level);
+    BLFWriter(const char *filepath, const blf_writer_config_t &config);
+    // Writes synchronously from the caller's storage and allocates nothing.
+    // queue_depth, write_index, io_uring_depth and direct_io are ignored,
+    // and checkpoint_ms only checked when a container is written.
+    BLFWriter(const char *filepath, const blf_writer_config_t &config, const blf_writer_storage_t &storage);
     ~BLFWriter();
+    // Writes out everything logged so far and checkpoints the file
+    void sync();
+    // Finishes and closes the file, anything logged afterwards is dropped
+    void stop();
+    blf_writer_stats_t stats();
+    // Bytes in the file so far, containers still being compressed or
+    // queued are not included. Safe to call from any thread.
+    uint64_t file_size() const { return _file_size_written.load(std::memory_order_relaxed); }
+    void set_trace_hook(blf_trace_fn fn, void *ctx);
     void on_message_received(uint64_t timestamp_ns, uint32_t arbitration_id, uint8_t *data, uint8_t dlc, uint16_t channel, bool is_extended_id, bool is_remote_frame, bool is_error_frame, bool is_fd, bool is_rx, bool bitrate_switch, bool error_state_indicator);
     void on_message_received(uint64_t timestamp_ns, uint32_t arbitration_id, uint8_t *data, uint8_t dlc);
+#ifdef __linux__
+    void write_batch(const blf_frame_t *frames, size_t n);
+#endif
 
   protected:
     size_t _uncompressed_size;
     uint32_t _count_of_objects;
-    FILE *_fd;
+    // Written with writev/pwrite directly, _file_size is the write position
+    int _fd;
+    uint64_t _file_size;
+    std::atomic<uint64_t> _file_size_written;
+    const uint32_t _preallocate;
+    uint64_t _allocated;
+    // Asynchronous writes, NULL when writing synchronously
+    struct io_ring_t;
+    io_ring_t *_ring;
+    // O_DIRECT staging buffer holding the last _direct_size bytes before
+    // _file_size, starting at an aligned file offset. NULL when not in
+    // direct mode.
+    uint8_t *_direct;
+    size_t _direct_size;
+    const uint32_t _container_size;
+    // Buffers and compressor belong to the caller
+    const bool _static_storage;
     uint32_t _buffer_size;
-    uint8_t _buffer[MAX_CONTAINER_SIZE];
+    uint8_t *_buffer;
+    uint32_t _reserved_size;
     uint64_t _start_timestamp, _stop_timestamp;
     int8_t _compression_level;
+    const bool _fd_message_64;
     const size_t _pCmpSize;
-    unsigned char *_pCmp; 
+    // Persistent deflate state, reset rather than reallocated for each container
+    typedef struct {
+        void *state; // tdefl_compressor
+        uint8_t *out;
+    } compressor_t;
+    const int _comp_flags;
+    compressor_t _storage_compressor;
+    compressor_t *_compressor;
+
+    // What went into a container, for the index
+    typedef struct {
+        uint32_t objects;
+        uint64_t min_timestamp, max_timestamp;
+        uint8_t id_filter[BLF_ID_FILTER_BITS / 8];
+    } container_meta_t;
+    container_meta_t _meta;
+    FILE *_index_fd;
+    uint32_t _index_count;
+
+    // Totals of the containers written so far, for checkpoints
+    uint32_t _written_objects;
+    uint64_t _written_max_timestamp;
+    const uint32_t _checkpoint_containers, _checkpoint_ms;
+    uint32_t _containers_since_checkpoint;
+    std::chrono::steady_clock::time_point _last_checkpoint;
+    // Set by the timer thread once checkpoint_ms have passed
+    std::atomic<bool> _checkpoint_due;
+
+    // Container pool shared with the writer thread. Buffers cycle from
+    // _free to the ingest thread (_buffer) to _full and back to _free.
+    typedef struct {
+        uint8_t *data;
+        uint32_t size;
+        uint32_t seq;
+        container_meta_t meta;
+        bool checkpoint;
+    } container_t;
+    const uint8_t _queue_depth;
+    uint8_t *_pool;
+    uint8_t **_free;
+    uint32_t _free_count;
+    container_t *_full;
+    uint32_t _full_head, _full_count, _in_flight;
+    uint32_t _next_seq, _next_write_seq;
+    bool _stopping;
+    blf_writer_stats_t _stats;
+    std::mutex _mutex;
+    std::condition_variable _full_cv, _free_cv, _write_cv, _timer_cv;
+    std::vector<std::thread> _workers;
+    std::thread _timer;
+    blf_trace_fn _trace_fn;
+    void *_trace_ctx;
 
+    BLFWriter(const char *filepath, const blf_writer_config_t &config, const blf_writer_storage_t *storage);
     systemtime_t timestamp_to_systemtime(uint64_t timestamp_ns);
     void _add_object(blf_objtype_t, void *data, size_t size, uint64_t timestamp);
-    void _write_header();
+#ifdef __linux__
+    uint32_t _encode_frame(uint8_t *obj, const blf_frame_t &f);
+#endif
+    uint32_t _encode_message(uint8_t *obj, uint64_t timestamp_ns, uint32_t arbitration_id, const uint8_t *data, uint8_t dlc, uint16_t channel, bool is_extended_id, bool is_remote_frame, bool is_error_frame, bool is_fd, bool is_rx, bool bitrate_switch, bool error_state_indicator);
+    void _write_file(struct iovec *iov, int iovcnt);
+    void _preallocate_for(size_t size);
+    void _write_at(const uint8_t *data, size_t size, uint64_t offset);
+#ifdef __linux__
+    void _direct_append(const struct iovec *iov, int iovcnt, size_t size);
+    void _direct_finish();
+    io_ring_t *_ring_create(unsigned depth, size_t buffer_size);
+    void _ring_destroy(io_ring_t *ring);
+    void _ring_write(const struct iovec *iov, int iovcnt, size_t size, uint64_t offset);
+    void _ring_reap(bool wait);
+    void _ring_drain();
+#endif
+    void _write_header(uint64_t file_size, uint32_t count_of_objects, uint64_t stop_timestamp);
+    void _checkpoint();
+    void _write_index_header(uint64_t file_size, uint32_t count_of_objects, uint32_t count_of_entries);
     void _flush();
-    void _buffer_append(const void *data, size_t size);
+    compressor_t *_compressor_create();
+    void _compressor_destroy(compressor_t *compressor);
+    uint16_t _compress(const uint8_t *buffer, uint32_t buffer_size, compressor_t *compressor, const uint8_t **data, unsigned long *data_size);
+    void _write_container(const uint8_t *data, unsigned long data_size, uint16_t compression_method, uint32_t buffer_size, const container_meta_t &meta, bool checkpoint);
+    uint64_t _timedelta(uint64_t timestamp_ns) const;
+    void _track_object(uint64_t timedelta);
+    void _worker_main();
+    void _timer_main();
+    void *_reserve_object(blf_objtype_t type, size_t size, uint64_t timestamp_ns);
+    void _commit_object();
+    uint8_t *_reserve(size_t size);
+    void _commit(size_t size);
 };
 
 #endif //BLFLOGGER_H
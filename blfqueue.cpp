@@ -0,0 +1,274 @@
+#include "blfqueue.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#ifdef __linux__
+// Frames handed to BLFWriter::write_batch() at once
+#define BATCH_SIZE 256
+
+static uint64_t round_up_pow2(uint64_t n) {
+    uint64_t size = 2;
+    while (size < n) {
+        size <<= 1;
+    }
+    return size;
+}
+
+// Consumers are never signalled, back off from spinning to short sleeps
+static void idle_backoff(uint32_t &idle) {
+    if (++idle < 64) {
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(std::min(idle, 1000u)));
+    }
+}
+
+BLFConcurrentWriter::BLFConcurrentWriter(const char *filepath, const blf_concurrent_config_t &config) : _writer(filepath, config.writer),
+                                                                                                        _mask(round_up_pow2(config.capacity) - 1),
+                                                                                                        _cells(new cell_t[_mask + 1]),
+                                                                                                        _block_when_full(config.block_when_full),
+                                                                                                        _enqueue_pos(0),
+                                                                                                        _dequeue_pos(0),
+                                                                                                        _stopping(false),
+                                                                                                        _dropped(0) {
+    for (uint64_t i = 0; i <= _mask; i++) {
+        _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    _consumer = std::thread(&BLFConcurrentWriter::_consumer_main, this);
+}
+
+BLFConcurrentWriter::~BLFConcurrentWriter() {
+    _stopping.store(true, std::memory_order_release);
+    _consumer.join();
+    delete[] _cells;
+}
+
+/*
+A cell is free for position pos when its sequence equals pos, and holds
+the frame for pos once the producer sets it to pos + 1. The consumer
+frees it for the next lap by setting it to pos + capacity.
+*/
+bool BLFConcurrentWriter::push(const blf_frame_t &frame) {
+    uint64_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+    cell_t *cell;
+    for (;;) {
+        cell = &_cells[pos & _mask];
+        uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)(sequence - pos);
+        if (0 == diff) {
+            if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // full, the consumer has not freed this cell yet
+            if (!_block_when_full) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            std::this_thread::yield();
+            pos = _enqueue_pos.load(std::memory_order_relaxed);
+        } else {
+            pos = _enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    cell->frame = frame;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+/*
+Takes up to max frames in enqueue order, stopping early at a cell whose
+producer has claimed but not yet published it
+*/
+size_t BLFConcurrentWriter::_pop(blf_frame_t *frames, size_t max) {
+    size_t n = 0;
+    while (n < max) {
+        cell_t *cell = &_cells[_dequeue_pos & _mask];
+        if (cell->sequence.load(std::memory_order_acquire) != _dequeue_pos + 1) {
+            break;
+        }
+        frames[n++] = cell->frame;
+        cell->sequence.store(_dequeue_pos + _mask + 1, std::memory_order_release);
+        _dequeue_pos++;
+    }
+    return n;
+}
+
+void BLFConcurrentWriter::_consumer_main() {
+    blf_frame_t *batch = (blf_frame_t *)malloc(BATCH_SIZE * sizeof(blf_frame_t));
+    uint32_t idle = 0;
+    for (;;) {
+        // read before draining so nothing pushed before stopping is missed
+        bool stopping = _stopping.load(std::memory_order_acquire);
+        size_t n = _pop(batch, BATCH_SIZE);
+        if (n) {
+            _writer.write_batch(batch, n);
+            idle = 0;
+            continue;
+        }
+        if (stopping) {
+            break;
+        }
+        idle_backoff(idle);
+    }
+    free(batch);
+}
+
+BLFMergingWriter::BLFMergingWriter(const char *filepath, const blf_merging_config_t &config) : _writer(filepath, config.writer),
+                                                                                               _sources(std::max(config.sources, (uint16_t)1)),
+                                                                                               _mask(round_up_pow2(config.capacity) - 1),
+                                                                                               _window_ns(config.reorder_window_ns),
+                                                                                               _block_when_full(config.block_when_full),
+                                                                                               _rings(new ring_t[_sources]),
+                                                                                               _stopping(false),
+                                                                                               _dropped(0),
+                                                                                               _late(0) {
+    for (uint16_t i = 0; i < _sources; i++) {
+        _rings[i].head.store(0, std::memory_order_relaxed);
+        _rings[i].tail.store(0, std::memory_order_relaxed);
+        _rings[i].cached_head = 0;
+        _rings[i].cached_tail = 0;
+        _rings[i].frames = new blf_frame_t[_mask + 1];
+    }
+    _consumer = std::thread(&BLFMergingWriter::_consumer_main, this);
+}
+
+BLFMergingWriter::~BLFMergingWriter() {
+    _stopping.store(true, std::memory_order_release);
+    _consumer.join();
+    for (uint16_t i = 0; i < _sources; i++) {
+        delete[] _rings[i].frames;
+    }
+    delete[] _rings;
+}
+
+bool BLFMergingWriter::push(uint16_t source, const blf_frame_t &frame) {
+    if (source >= _sources) {
+        return false;
+    }
+    ring_t &ring = _rings[source];
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    // the consumer's position is only reloaded when the ring looks full
+    while (head - ring.cached_tail > _mask) {
+        ring.cached_tail = ring.tail.load(std::memory_order_acquire);
+        if (head - ring.cached_tail <= _mask) {
+            break;
+        }
+        if (!_block_when_full) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    ring.frames[head & _mask] = frame;
+    ring.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+/*
+Oldest frame of a source, NULL if its ring is empty
+*/
+const blf_frame_t *BLFMergingWriter::_peek(uint16_t source) {
+    ring_t &ring = _rings[source];
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail == ring.cached_head) {
+        ring.cached_head = ring.head.load(std::memory_order_acquire);
+        if (tail == ring.cached_head) {
+            return NULL;
+        }
+    }
+    return &ring.frames[tail & _mask];
+}
+
+void BLFMergingWriter::_consumer_main() {
+    blf_frame_t *batch = (blf_frame_t *)malloc(BATCH_SIZE * sizeof(blf_frame_t));
+    size_t n = 0;
+    // min-heap of the oldest frame of every non-empty ring
+    std::vector<head_t> heap;
+    heap.reserve(_sources);
+    std::vector<bool> in_heap(_sources, false);
+    // rings whose producer waits for room, or drops frames
+    std::vector<bool> full(_sources, false);
+    uint16_t full_count = 0;
+    auto later = [](const head_t &a, const head_t &b) { return a.timestamp_ns > b.timestamp_ns; };
+    uint64_t newest = 0, last_written = 0;
+    uint32_t idle = 0;
+
+    for (;;) {
+        // read before draining so nothing pushed before stopping is missed
+        bool stopping = _stopping.load(std::memory_order_acquire);
+        bool arrived = false;
+        full_count = 0;
+        for (uint16_t source = 0; source < _sources; source++) {
+            ring_t &ring = _rings[source];
+            uint64_t head = ring.head.load(std::memory_order_acquire);
+            uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+            arrived = arrived || head != ring.cached_head;
+            ring.cached_head = head;
+            full[source] = head - tail > _mask;
+            full_count += full[source];
+            if (head == tail) {
+                continue;
+            }
+            // the latest frame pushed, the ring is in timestamp order
+            newest = std::max(newest, ring.frames[(head - 1) & _mask].timestamp_ns);
+            if (!in_heap[source]) {
+                heap.push_back({ring.frames[tail & _mask].timestamp_ns, source});
+                std::push_heap(heap.begin(), heap.end(), later);
+                in_heap[source] = true;
+            }
+        }
+
+        while (!heap.empty()) {
+            head_t oldest = heap.front();
+            // see the class comment
+            if (heap.size() < _sources && !stopping && 0 == full_count && newest - oldest.timestamp_ns < _window_ns) {
+                break;
+            }
+            std::pop_heap(heap.begin(), heap.end(), later);
+            heap.pop_back();
+
+            ring_t &ring = _rings[oldest.source];
+            uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+            batch[n++] = ring.frames[tail & _mask];
+            ring.tail.store(tail + 1, std::memory_order_release);
+            if (full[oldest.source]) {
+                full[oldest.source] = false;
+                full_count--;
+            }
+            if (oldest.timestamp_ns < last_written) {
+                _late.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                last_written = oldest.timestamp_ns;
+            }
+            if (BATCH_SIZE == n) {
+                _writer.write_batch(batch, n);
+                n = 0;
+            }
+
+            const blf_frame_t *f = _peek(oldest.source);
+            if (f) {
+                heap.push_back({f->timestamp_ns, oldest.source});
+                std::push_heap(heap.begin(), heap.end(), later);
+            } else {
+                in_heap[oldest.source] = false;
+            }
+        }
+
+        if (n) {
+            _writer.write_batch(batch, n);
+            n = 0;
+            idle = 0;
+            continue;
+        }
+        if (stopping && heap.empty()) {
+            break;
+        }
+        if (!arrived) {
+            idle_backoff(idle);
+        }
+    }
+    free(batch);
+}
+#endif
@@ -0,0 +1,128 @@
+#ifndef BLFQUEUE_H
+#define BLFQUEUE_H
+
+#include "blflogger.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+#ifdef __linux__
+typedef struct {
+    blf_writer_config_t writer;
+    // Frames buffered between the producers and the writer, rounded up to
+    // a power of two
+    uint32_t capacity = 65536;
+    // Wait for room when the ring is full instead of dropping the frame
+    bool block_when_full = true;
+} blf_concurrent_config_t;
+
+/*
+Thread-safe front-end of a BLFWriter. Any number of threads push frames
+into a bounded lock-free ring (Vyukov's MPSC queue: producers claim a
+cell with one CAS and publish it with a per-cell sequence number), and a
+single consumer thread drains it into the writer in batches. Producers
+never take a lock and never wait for compression or I/O.
+*/
+class BLFConcurrentWriter {
+  public:
+    BLFConcurrentWriter(const char *filepath, const blf_concurrent_config_t &config);
+    // All producers must be done pushing
+    ~BLFConcurrentWriter();
+    // Returns false if the ring was full and the frame dropped
+    bool push(const blf_frame_t &frame);
+    uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+  protected:
+    typedef struct {
+        std::atomic<uint64_t> sequence;
+        blf_frame_t frame;
+    } cell_t;
+
+    BLFWriter _writer;
+    const uint64_t _mask;
+    cell_t *_cells;
+    const bool _block_when_full;
+    // producers and the consumer each on their own cache line
+    alignas(64) std::atomic<uint64_t> _enqueue_pos;
+    alignas(64) uint64_t _dequeue_pos;
+    std::atomic<bool> _stopping;
+    std::thread _consumer;
+    // bumped by producers finding the ring full, kept off the consumer's line
+    alignas(64) std::atomic<uint64_t> _dropped;
+
+    size_t _pop(blf_frame_t *frames, size_t max);
+    void _consumer_main();
+};
+
+typedef struct {
+    blf_writer_config_t writer;
+    // Number of sources, each with its own ring and a single producer
+    uint16_t sources = 1;
+    // Frames buffered per source, rounded up to a power of two
+    uint32_t capacity = 16384;
+    // How far in frame time a source may lag behind the others, see
+    // BLFMergingWriter
+    uint64_t reorder_window_ns = 10000000;
+    bool block_when_full = true;
+} blf_merging_config_t;
+
+/*
+Writes frames from several sources, e.g. one thread per CAN interface,
+in timestamp order. Each source pushes into its own single-producer ring
+in the order of its own timestamps, and the consumer thread merges the
+rings by timestamp with a heap of their oldest frames.
+
+Frames are released by frame time alone: the oldest frame is written
+once every ring has a frame, as nothing older can then arrive, or once
+a frame at least reorder_window_ns newer has been pushed by any source.
+A full ring also releases frames up to its oldest one, as its producer
+could not go on otherwise. Whatever is still held when the bus goes
+quiet is written on destruction. Frames from a source lagging further
+behind are written as they arrive and counted as late, those older than
+the first frame written get the start time of the log.
+*/
+class BLFMergingWriter {
+  public:
+    BLFMergingWriter(const char *filepath, const blf_merging_config_t &config);
+    // All producers must be done pushing
+    ~BLFMergingWriter();
+    // Only one thread may push for a source at a time
+    bool push(uint16_t source, const blf_frame_t &frame);
+    uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+    // Frames written after a newer frame from another source
+    uint64_t late() const { return _late.load(std::memory_order_relaxed); }
+
+  protected:
+    typedef struct {
+        // written by the producer
+        alignas(64) std::atomic<uint64_t> head;
+        uint64_t cached_tail;
+        // written by the consumer
+        alignas(64) std::atomic<uint64_t> tail;
+        uint64_t cached_head;
+        blf_frame_t *frames;
+    } ring_t;
+
+    typedef struct {
+        uint64_t timestamp_ns;
+        uint16_t source;
+    } head_t;
+
+    BLFWriter _writer;
+    const uint16_t _sources;
+    const uint64_t _mask;
+    const uint64_t _window_ns;
+    const bool _block_when_full;
+    ring_t *_rings;
+    std::atomic<bool> _stopping;
+    std::atomic<uint64_t> _dropped;
+    std::atomic<uint64_t> _late;
+    std::thread _consumer;
+
+    const blf_frame_t *_peek(uint16_t source);
+    void _consumer_main();
+};
+#endif
+
+#endif //BLFQUEUE_H
@@ -0,0 +1,465 @@
+#include "blfreader.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "miniz/miniz.h"
+
+BLFReader::BLFReader(const char *filepath, const blf_reader_config_t &config) : _fd(open(filepath, O_RDONLY)),
+                                                                                _map(NULL),
+                                                                                _map_size(0),
+                                                                                _pos(0),
+                                                                                _data(NULL),
+                                                                                _data_size(0),
+                                                                                _data_pos(0),
+                                                                                _data_in_slot(false),
+                                                                                _container(NULL),
+                                                                                _container_capacity(0),
+                                                                                _index_path(NULL),
+                                                                                _index_loaded(false),
+                                                                                _index(NULL),
+                                                                                _index_max_before(NULL),
+                                                                                _index_min_after(NULL),
+                                                                                _index_count(0),
+                                                                                _index_next(0),
+                                                                                _index_end(0),
+                                                                                _index_active(false),
+                                                                                _range_active(false),
+                                                                                _range_start(0),
+                                                                                _range_end(0),
+                                                                                _read_ahead(std::max(config.read_ahead, (uint8_t)1)),
+                                                                                _slots((slot_t *)calloc(_read_ahead, sizeof(slot_t))),
+                                                                                _head(0),
+                                                                                _count(0),
+                                                                                _stopping(false) {
+    memset(&_header, 0, sizeof(_header));
+    struct stat st;
+    if (_fd < 0 || fstat(_fd, &st) < 0 || st.st_size < (off_t)sizeof(file_header_t)) {
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (MAP_FAILED == map) {
+        return;
+    }
+    memcpy(&_header, map, sizeof(_header));
+    if (memcmp(_header.signature, "LOGG", 4)) {
+        fprintf(stderr, "not a BLF file\n");
+        munmap(map, st.st_size);
+        return;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    _map = (const uint8_t *)map;
+    _map_size = st.st_size;
+    _pos = _header.header_size;
+
+    size_t len = strlen(filepath);
+    _index_path = (char *)malloc(len + sizeof(".idx"));
+    memcpy(_index_path, filepath, len);
+    memcpy(_index_path + len, ".idx", sizeof(".idx"));
+
+    for (auto i = 0; i < config.threads; i++) {
+        _workers.emplace_back(&BLFReader::_worker_main, this);
+    }
+}
+
+BLFReader::BLFReader(const char *filepath) : BLFReader(filepath, blf_reader_config_t()) {}
+
+BLFReader::~BLFReader() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _pending_cv.notify_all();
+    for (auto &worker : _workers) {
+        worker.join();
+    }
+    for (auto i = 0; i < _read_ahead; i++) {
+        free(_slots[i].buffer);
+    }
+    free(_slots);
+    if (_map) {
+        munmap((void *)_map, _map_size);
+    }
+    if (_fd >= 0) {
+        close(_fd);
+    }
+    free(_container);
+    free(_index_path);
+    free(_index);
+    free(_index_max_before);
+    free(_index_min_after);
+}
+
+/*
+Parses the object at p. Returns 0 if fewer than avail bytes are left for
+it, which happens when an object continues in the next container, and -1
+if p does not point at an object.
+*/
+int BLFReader::_parse_object(const uint8_t *p, size_t avail, blf_object_t *obj, size_t *consumed) {
+    obj_header_base_t base;
+    if (avail < sizeof(base)) {
+        return 0;
+    }
+    memcpy(&base, p, sizeof(base));
+    if (memcmp(base.signature, "LOBJ", 4) || base.header_size < sizeof(base) || base.header_size > base.object_size) {
+        return -1;
+    }
+    if (base.object_size > avail) {
+        return 0;
+    }
+
+    obj->type = base.object_type;
+    obj->flags = 0;
+    obj->timestamp = 0;
+    // v1 and v2 object headers both keep flags and timestamp at these offsets
+    if (base.header_size >= sizeof(obj_header_base_t) + sizeof(obj_header_v1_t)) {
+        memcpy(&obj->flags, p + sizeof(base), sizeof(obj->flags));
+        memcpy(&obj->timestamp, p + sizeof(base) + offsetof(obj_header_v1_t, timestamp), sizeof(obj->timestamp));
+    }
+    obj->data = p + base.header_size;
+    obj->size = base.object_size - base.header_size;
+
+    // CAN_FD_MESSAGE_64 objects are not padded
+    size_t size = base.object_size + (CAN_FD_MESSAGE_64 == base.object_type ? 0 : base.object_size % 4);
+    *consumed = size < avail ? size : avail;
+    return 1;
+}
+
+/*
+Fills free slots with the next top level objects: those following the
+last scheduled one, or the indexed containers overlapping the seek range.
+Uncompressed data is used in place, compressed containers are left for
+the workers or for _advance() to inflate. Called with _mutex held.
+*/
+void BLFReader::_schedule() {
+    while (_count < _read_ahead) {
+        if (_index_active) {
+            while (_index_next < _index_end && !_index_match(_index[_index_next])) {
+                _index_next++;
+            }
+            if (_index_next == _index_end) {
+                break;
+            }
+            _pos = _index[_index_next++].offset;
+        }
+        if (!_schedule_object()) {
+            break;
+        }
+    }
+    _pending_cv.notify_all();
+}
+
+bool BLFReader::_schedule_object() {
+    obj_header_base_t base;
+    if (_pos + sizeof(base) > _map_size) {
+        return false;
+    }
+    memcpy(&base, _map + _pos, sizeof(base));
+    if (memcmp(base.signature, "LOBJ", 4) || base.object_size < sizeof(base) || _pos + base.object_size > _map_size) {
+        fprintf(stderr, "truncated or corrupt object at offset %zu\n", _pos);
+        _pos = _map_size;
+        _index_active = false;
+        return false;
+    }
+
+    slot_t *slot = &_slots[(_head + _count) % _read_ahead];
+    slot->offset = _pos;
+    if (LOG_CONTAINER == base.object_type && base.object_size >= base.header_size + sizeof(log_container_t)) {
+        log_container_t container;
+        memcpy(&container, _map + _pos + base.header_size, sizeof(container));
+        slot->payload = _map + _pos + base.header_size + sizeof(container);
+        slot->payload_size = base.object_size - base.header_size - sizeof(container);
+        slot->size_uncompressed = container.size_uncompressed;
+        if (ZLIB_DEFLATE == container.compression_method) {
+            slot->state = SLOT_PENDING;
+        } else if (NO_COMPRESSION == container.compression_method) {
+            slot->data = slot->payload;
+            slot->size = std::min(slot->payload_size, (size_t)container.size_uncompressed);
+            slot->state = SLOT_READY;
+        } else {
+            fprintf(stderr, "unknown compression method %u\n", container.compression_method);
+            slot->state = SLOT_FAILED;
+        }
+        _pos += base.object_size + base.object_size % 4;
+    } else {
+        // objects may also be stored outside of containers
+        size_t size = base.object_size + (CAN_FD_MESSAGE_64 == base.object_type ? 0 : base.object_size % 4);
+        slot->data = _map + _pos;
+        slot->size = std::min(size, _map_size - _pos);
+        slot->state = SLOT_READY;
+        _pos += slot->size;
+    }
+    _count++;
+    return true;
+}
+
+bool BLFReader::_load_index() {
+    _index_loaded = true;
+    FILE *fd = fopen(_index_path, "rb");
+    if (NULL == fd) {
+        return false;
+    }
+
+    blf_index_header_t header;
+    bool ok = 1 == fread(&header, sizeof(header), 1, fd) && 0 == memcmp(header.signature, "BLFI", 4) &&
+              header.header_size >= sizeof(header) && sizeof(blf_index_entry_t) == header.entry_size;
+    // written for another file of the same name, or not updated along with it
+    if (ok && (header.file_size != _header.file_size || header.count_of_objects != _header.count_of_objects)) {
+        fprintf(stderr, "%s does not match the file, ignoring it\n", _index_path);
+        ok = false;
+    }
+    if (ok) {
+        fseek(fd, 0, SEEK_END);
+        size_t count = (ftell(fd) - header.header_size) / header.entry_size;
+        if (header.count_of_entries && header.count_of_entries < count) {
+            count = header.count_of_entries;
+        }
+        fseek(fd, header.header_size, SEEK_SET);
+        _index = (blf_index_entry_t *)malloc(count * sizeof(blf_index_entry_t) + 1);
+        _index_max_before = (uint64_t *)malloc(count * sizeof(uint64_t) + 1);
+        _index_min_after = (uint64_t *)malloc(count * sizeof(uint64_t) + 1);
+        ok = _index && _index_max_before && _index_min_after && count == fread(_index, sizeof(blf_index_entry_t), count, fd);
+        _index_count = ok ? count : 0;
+    }
+    fclose(fd);
+    // entries past a truncated file
+    while (_index_count && _index[_index_count - 1].offset + _index[_index_count - 1].object_size > _map_size) {
+        _index_count--;
+    }
+
+    for (size_t i = 0; i < _index_count; i++) {
+        _index_max_before[i] = i ? std::max(_index_max_before[i - 1], _index[i].max_timestamp) : _index[i].max_timestamp;
+    }
+    for (size_t i = _index_count; i-- > 0;) {
+        _index_min_after[i] = i + 1 < _index_count ? std::min(_index_min_after[i + 1], _index[i].min_timestamp) : _index[i].min_timestamp;
+    }
+    return ok;
+}
+
+bool BLFReader::_index_match(const blf_index_entry_t &entry) const {
+    if (_range_active && (entry.max_timestamp < _range_start || entry.min_timestamp > _range_end)) {
+        return false;
+    }
+    if (_ids.empty()) {
+        return true;
+    }
+    for (uint32_t id : _ids) {
+        if (blf_id_filter_test(entry.id_filter, id)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BLFReader::seek_time(uint64_t start_ns, uint64_t end_ns) {
+    _range_active = true;
+    _range_start = start_ns;
+    _range_end = end_ns;
+    return _restart();
+}
+
+bool BLFReader::filter_ids(const uint32_t *ids, size_t n) {
+    _ids.assign(ids, ids + n);
+    std::sort(_ids.begin(), _ids.end());
+    return _restart();
+}
+
+/*
+Drops everything scheduled so far and starts over at the first container
+that may match the time range and id filter
+*/
+bool BLFReader::_restart() {
+    if (NULL == _map) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    // let containers being inflated finish before recycling their slots
+    _ready_cv.wait(lock, [this] {
+        for (uint32_t i = 0; i < _read_ahead; i++) {
+            if (SLOT_INFLATING == _slots[i].state) {
+                return false;
+            }
+        }
+        return true;
+    });
+    for (uint32_t i = 0; i < _read_ahead; i++) {
+        _slots[i].state = SLOT_FREE;
+    }
+    _head = _count = 0;
+    _data = NULL;
+    _data_size = _data_pos = 0;
+    _data_in_slot = false;
+
+    if (!_index_loaded) {
+        _load_index();
+    }
+    _index_active = _index_count > 0;
+    if (!_index_active) {
+        _pos = _header.header_size;
+        return false;
+    }
+    _index_next = 0;
+    _index_end = _index_count;
+    if (_range_active) {
+        _index_next = std::lower_bound(_index_max_before, _index_max_before + _index_count, _range_start) - _index_max_before;
+        _index_end = std::upper_bound(_index_min_after, _index_min_after + _index_count, _range_end) - _index_min_after;
+    }
+    return true;
+}
+
+/*
+Inflates a container into the slot's buffer. The caller publishes the
+result by updating the slot state under _mutex.
+*/
+bool BLFReader::_inflate(slot_t *slot) {
+    if (slot->size_uncompressed > slot->capacity) {
+        free(slot->buffer);
+        slot->buffer = (uint8_t *)malloc(slot->size_uncompressed);
+        slot->capacity = slot->buffer ? slot->size_uncompressed : 0;
+    }
+    size_t size = TINFL_DECOMPRESS_MEM_TO_MEM_FAILED;
+    if (slot->buffer) {
+        size = tinfl_decompress_mem_to_mem(slot->buffer, slot->size_uncompressed, slot->payload, slot->payload_size, TINFL_FLAG_PARSE_ZLIB_HEADER);
+    }
+    if (TINFL_DECOMPRESS_MEM_TO_MEM_FAILED == size) {
+        fprintf(stderr, "failed to inflate container at offset %zu\n", slot->offset);
+        return false;
+    }
+    slot->data = slot->buffer;
+    slot->size = size;
+    return true;
+}
+
+void BLFReader::_worker_main() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+        slot_t *slot = NULL;
+        _pending_cv.wait(lock, [&] {
+            for (uint32_t i = 0; i < _count && !slot; i++) {
+                slot_t *s = &_slots[(_head + i) % _read_ahead];
+                if (SLOT_PENDING == s->state) {
+                    slot = s;
+                }
+            }
+            return slot || _stopping;
+        });
+        if (!slot) {
+            break;
+        }
+        slot->state = SLOT_INFLATING;
+
+        lock.unlock();
+        bool ok = _inflate(slot);
+        lock.lock();
+        slot->state = ok ? SLOT_READY : SLOT_FAILED;
+        _ready_cv.notify_all();
+    }
+}
+
+/*
+Moves on to the objects of the next slot, carrying over any partial
+object left at the end of the current one. Returns false at end of file.
+*/
+bool BLFReader::_advance() {
+    // indexed seeks jump between containers, nothing carries over
+    size_t tail = _index_active ? 0 : _data_size - _data_pos;
+    if (tail > _container_capacity) {
+        uint8_t *buf = (uint8_t *)malloc(tail);
+        if (NULL == buf) {
+            return false;
+        }
+        memcpy(buf, _data + _data_pos, tail);
+        free(_container);
+        _container = buf;
+        _container_capacity = tail;
+    } else if (tail) {
+        memmove(_container, _data + _data_pos, tail);
+    }
+    _data_size = _data_pos = 0;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_data_in_slot) {
+        _slots[_head].state = SLOT_FREE;
+        _head = (_head + 1) % _read_ahead;
+        _count--;
+        _data_in_slot = false;
+    }
+    _schedule();
+    if (0 == _count) {
+        return false;
+    }
+
+    slot_t *slot = &_slots[_head];
+    if (_workers.empty() && SLOT_PENDING == slot->state) {
+        slot->state = _inflate(slot) ? SLOT_READY : SLOT_FAILED;
+    }
+    _ready_cv.wait(lock, [&] { return SLOT_READY == slot->state || SLOT_FAILED == slot->state; });
+    if (SLOT_FAILED == slot->state) {
+        return false;
+    }
+
+    if (0 == tail) {
+        _data = slot->data;
+        _data_size = slot->size;
+        _data_in_slot = true;
+        return true;
+    }
+
+    // an object spans both containers, join them in _container
+    if (tail + slot->size > _container_capacity) {
+        uint8_t *buf = (uint8_t *)realloc(_container, tail + slot->size);
+        if (NULL == buf) {
+            return false;
+        }
+        _container = buf;
+        _container_capacity = tail + slot->size;
+    }
+    memcpy(_container + tail, slot->data, slot->size);
+    _data = _container;
+    _data_size = tail + slot->size;
+    slot->state = SLOT_FREE;
+    _head = (_head + 1) % _read_ahead;
+    _count--;
+    return true;
+}
+
+bool BLFReader::next(blf_object_t *obj) {
+    if (NULL == _map) {
+        return false;
+    }
+
+    for (;;) {
+        size_t consumed;
+        int status = _parse_object(_data + _data_pos, _data_size - _data_pos, obj, &consumed);
+        if (status > 0) {
+            _data_pos += consumed;
+            if (_range_active) {
+                uint64_t timestamp = blf_object_timestamp_ns(*obj);
+                if (timestamp < _range_start || timestamp > _range_end) {
+                    continue;
+                }
+            }
+            if (!_ids.empty()) {
+                uint32_t id;
+                if (!blf_object_arbitration_id(*obj, &id) || !std::binary_search(_ids.begin(), _ids.end(), id)) {
+                    continue;
+                }
+            }
+            return true;
+        } else if (status < 0) {
+            fprintf(stderr, "corrupt object in container before offset %zu\n", _pos);
+            _data_pos = _data_size;
+        }
+
+        if (!_advance()) {
+            return false;
+        }
+    }
+}
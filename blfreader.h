@@ -0,0 +1,166 @@
+#ifndef BLFREADER_H
+#define BLFREADER_H
+
+#include "blflogger.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+One object as found in the file. data points into the memory mapped file
+or into the reader's inflated container and stays valid until the next
+call to BLFReader::next().
+*/
+typedef struct {
+    uint32_t type;
+    uint32_t flags;
+    // as stored, in units given by flags and relative to the start of the log
+    uint64_t timestamp;
+    uint32_t size;
+    const uint8_t *data;
+} blf_object_t;
+
+static inline uint64_t blf_object_timestamp_ns(const blf_object_t &obj) {
+    return (obj.flags & TIME_TEN_MICS) ? obj.timestamp * 10000 : obj.timestamp;
+}
+
+// Typed views of the payload, NULL if the object is of another type
+static inline const can_msg_t *blf_can_msg(const blf_object_t &obj) {
+    return (CAN_MESSAGE == obj.type || CAN_MESSAGE2 == obj.type) && obj.size >= sizeof(can_msg_t) ? (const can_msg_t *)obj.data : NULL;
+}
+
+static inline const can_fd_msg_t *blf_can_fd_msg(const blf_object_t &obj) {
+    return CAN_FD_MESSAGE == obj.type && obj.size >= sizeof(can_fd_msg_t) ? (const can_fd_msg_t *)obj.data : NULL;
+}
+
+// Only the first min(valid_bytes, obj.size - offsetof(can_fd_msg_64_t, data))
+// bytes of data are in the object
+static inline const can_fd_msg_64_t *blf_can_fd_msg_64(const blf_object_t &obj) {
+    return CAN_FD_MESSAGE_64 == obj.type && obj.size >= offsetof(can_fd_msg_64_t, data) ? (const can_fd_msg_64_t *)obj.data : NULL;
+}
+
+// Arbitration id without CAN_MSG_EXT of CAN and CAN FD messages
+static inline bool blf_object_arbitration_id(const blf_object_t &obj, uint32_t *id) {
+    if (const can_msg_t *msg = blf_can_msg(obj)) {
+        *id = msg->arbitration_id & ~CAN_MSG_EXT;
+    } else if (const can_fd_msg_t *msg = blf_can_fd_msg(obj)) {
+        *id = msg->arbitration_id & ~CAN_MSG_EXT;
+    } else if (const can_fd_msg_64_t *msg = blf_can_fd_msg_64(obj)) {
+        *id = msg->arbitration_id & ~CAN_MSG_EXT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static inline const can_error_ext_t *blf_can_error_ext(const blf_object_t &obj) {
+    return CAN_ERROR_EXT == obj.type && obj.size >= sizeof(can_error_ext_t) ? (const can_error_ext_t *)obj.data : NULL;
+}
+
+typedef struct {
+    // Threads inflating containers ahead of the reader, 0 inflates inline
+    uint8_t threads = 0;
+    // Containers scanned and inflated ahead of the one being iterated
+    uint8_t read_ahead = 8;
+} blf_reader_config_t;
+
+/*
+Iterates over the objects of a BLF file in file order. The file is memory
+mapped and each LOG_CONTAINER is inflated into a reusable buffer, objects
+are handed out as views without copying them. With threads set, upcoming
+containers are inflated concurrently while earlier ones are iterated.
+*/
+class BLFReader {
+  public:
+    BLFReader(const char *filepath);
+    BLFReader(const char *filepath, const blf_reader_config_t &config);
+    ~BLFReader();
+    bool is_open() const { return NULL != _map; }
+    const file_header_t &header() const { return _header; }
+    bool next(blf_object_t *obj);
+    // Restarts iteration limited to objects with timestamps in [start_ns,
+    // end_ns], relative to the start of the log. With the sidecar index
+    // written by BLFWriter only containers overlapping the range are
+    // inflated, otherwise the whole file is scanned. Returns true if the
+    // index was used.
+    bool seek_time(uint64_t start_ns, uint64_t end_ns);
+    // Restarts iteration limited to CAN and CAN FD messages with one of
+    // the n arbitration ids (without CAN_MSG_EXT), n = 0 clears the filter.
+    // Combines with seek_time(). With the sidecar index only containers
+    // whose id filter may hold one of the ids are inflated. Returns true if
+    // the index was used.
+    bool filter_ids(const uint32_t *ids, size_t n);
+
+  protected:
+    enum {
+        SLOT_FREE,
+        SLOT_PENDING,
+        SLOT_INFLATING,
+        SLOT_READY,
+        SLOT_FAILED,
+    };
+
+    // One top level object scanned ahead, usually a container
+    typedef struct {
+        int state;
+        size_t offset;
+        const uint8_t *payload;
+        size_t payload_size;
+        uint32_t size_uncompressed;
+        // objects found in the slot
+        const uint8_t *data;
+        size_t size;
+        uint8_t *buffer;
+        size_t capacity;
+    } slot_t;
+
+    file_header_t _header;
+    int _fd;
+    const uint8_t *_map;
+    size_t _map_size;
+    // file offset of the next top level object to scan
+    size_t _pos;
+    // objects currently iterated, either a slot's data or, when an object
+    // continues from the previous container, a copy in _container
+    const uint8_t *_data;
+    size_t _data_size, _data_pos;
+    bool _data_in_slot;
+    uint8_t *_container;
+    size_t _container_capacity;
+
+    // Sidecar index, loaded on first use. The running maximum of
+    // max_timestamp and the trailing minimum of min_timestamp are
+    // monotonic and give the candidate range by binary search.
+    char *_index_path;
+    bool _index_loaded;
+    blf_index_entry_t *_index;
+    uint64_t *_index_max_before, *_index_min_after;
+    size_t _index_count, _index_next, _index_end;
+    bool _index_active, _range_active;
+    uint64_t _range_start, _range_end;
+    // sorted
+    std::vector<uint32_t> _ids;
+
+    const uint8_t _read_ahead;
+    slot_t *_slots;
+    uint32_t _head, _count;
+    bool _stopping;
+    std::mutex _mutex;
+    std::condition_variable _pending_cv, _ready_cv;
+    std::vector<std::thread> _workers;
+
+    bool _load_index();
+    bool _restart();
+    bool _index_match(const blf_index_entry_t &entry) const;
+    void _schedule();
+    bool _schedule_object();
+    bool _advance();
+    bool _inflate(slot_t *slot);
+    void _worker_main();
+    int _parse_object(const uint8_t *p, size_t avail, blf_object_t *obj, size_t *consumed);
+};
+
+#endif //BLFREADER_H
@@ -0,0 +1,547 @@
+/*
+Repairs BLF files left behind by a logger that did not shut down cleanly.
+
+The file is walked object by object from the end of the file header.
+Where the walk hits something that is not a valid object it resyncs on
+the next "LOBJ" signature, found with an SSE2 or NEON scan. Every
+container is validated by inflating it, which also checks the zlib
+Adler-32, on a pool of threads. The objects inside are counted and
+their timestamps collected. Valid objects are copied into a temporary
+file, dropping invalid containers, garbage between objects and the torn
+tail, and a header with the recomputed size, object count and stop time
+is written. The temporary file is synced and renamed over the original.
+A sidecar index next to the file is rebuilt to match.
+
+The start time can only be kept if the old header has one, a zeroed
+header from a crashed logger leaves both times unset.
+*/
+#include "blfrepair.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <fcntl.h>
+#include <limits.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "miniz/miniz.h"
+
+// Top level objects validated per round of the thread pool
+#define BATCH_SIZE 256
+
+typedef struct {
+    size_t offset;
+    // object size as in the header and including padding
+    uint32_t object_size;
+    size_t size;
+    bool is_container;
+    const uint8_t *payload;
+    size_t payload_size;
+    uint32_t size_uncompressed;
+    uint16_t compression_method;
+    bool ok;
+    // inflated objects of a container
+    const uint8_t *data;
+    size_t data_size;
+    uint8_t *buffer;
+    size_t capacity;
+} entry_t;
+
+typedef struct {
+    uint64_t objects;
+    uint64_t uncompressed_size;
+    uint64_t max_timestamp;
+    uint32_t containers;
+    uint32_t dropped;
+    uint64_t skipped_bytes;
+    // end of the repaired data, where the next valid object is copied to
+    uint64_t file_size;
+} totals_t;
+
+/*
+Returns the first "LOBJ" at or after p, or end
+*/
+static const uint8_t *find_signature(const uint8_t *p, const uint8_t *end) {
+#if defined(__SSE2__)
+    const __m128i l = _mm_set1_epi8('L'), o = _mm_set1_epi8('O'), b = _mm_set1_epi8('B'), j = _mm_set1_epi8('J');
+    while (p + 16 + 3 <= end) {
+        __m128i match = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), l), _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 1)), o)),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 2)), b), _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 3)), j)));
+        int mask = _mm_movemask_epi8(match);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#elif defined(__ARM_NEON)
+    while (p + 16 + 3 <= end) {
+        uint8x16_t match = vandq_u8(
+            vandq_u8(vceqq_u8(vld1q_u8(p), vdupq_n_u8('L')), vceqq_u8(vld1q_u8(p + 1), vdupq_n_u8('O'))),
+            vandq_u8(vceqq_u8(vld1q_u8(p + 2), vdupq_n_u8('B')), vceqq_u8(vld1q_u8(p + 3), vdupq_n_u8('J'))));
+        // four bits per byte
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0);
+        if (mask) {
+            return p + __builtin_ctzll(mask) / 4;
+        }
+        p += 16;
+    }
+#endif
+    for (; p + 4 <= end; p++) {
+        if ('L' == p[0] && 0 == memcmp(p, "LOBJ", 4)) {
+            return p;
+        }
+    }
+    return end;
+}
+
+/*
+Checks the object header at offset and fills in entry. Only the header is
+checked here, containers are validated by inflating them.
+*/
+static bool parse_entry(const uint8_t *map, size_t map_size, size_t offset, entry_t *entry) {
+    obj_header_base_t base;
+    if (offset + sizeof(base) > map_size) {
+        return false;
+    }
+    memcpy(&base, map + offset, sizeof(base));
+    if (memcmp(base.signature, "LOBJ", 4) || base.header_size < sizeof(base) || base.object_size < base.header_size ||
+        base.object_size > map_size - offset || (1 != base.header_version && 2 != base.header_version) || 0 == base.object_type) {
+        return false;
+    }
+
+    entry->offset = offset;
+    entry->object_size = base.object_size;
+    entry->size = std::min((size_t)base.object_size + (CAN_FD_MESSAGE_64 == base.object_type ? 0 : base.object_size % 4), map_size - offset);
+    entry->is_container = LOG_CONTAINER == base.object_type;
+    entry->ok = !entry->is_container;
+    if (!entry->is_container) {
+        return true;
+    }
+
+    log_container_t container;
+    if (base.object_size < base.header_size + sizeof(container)) {
+        return false;
+    }
+    memcpy(&container, map + offset + base.header_size, sizeof(container));
+    if (ZLIB_DEFLATE != container.compression_method && NO_COMPRESSION != container.compression_method) {
+        return false;
+    }
+    entry->payload = map + offset + base.header_size + sizeof(container);
+    entry->payload_size = base.object_size - base.header_size - sizeof(container);
+    entry->size_uncompressed = container.size_uncompressed;
+    entry->compression_method = container.compression_method;
+    return true;
+}
+
+static void inflate_entry(entry_t *entry) {
+    if (!entry->is_container) {
+        return;
+    }
+    if (NO_COMPRESSION == entry->compression_method) {
+        entry->data = entry->payload;
+        entry->data_size = entry->payload_size;
+        entry->ok = entry->payload_size >= entry->size_uncompressed;
+        return;
+    }
+    if (entry->size_uncompressed > entry->capacity) {
+        free(entry->buffer);
+        entry->buffer = (uint8_t *)malloc(entry->size_uncompressed);
+        entry->capacity = entry->buffer ? entry->size_uncompressed : 0;
+    }
+    size_t size = TINFL_DECOMPRESS_MEM_TO_MEM_FAILED;
+    if (entry->buffer) {
+        // parsing the zlib header also verifies the Adler-32 of the data
+        size = tinfl_decompress_mem_to_mem(entry->buffer, entry->size_uncompressed, entry->payload, entry->payload_size, TINFL_FLAG_PARSE_ZLIB_HEADER);
+    }
+    entry->ok = size == entry->size_uncompressed;
+    entry->data = entry->buffer;
+    entry->data_size = entry->ok ? size : 0;
+}
+
+/*
+Inflates batches of entries on the calling thread and threads - 1 workers,
+which are started once and wait for the next batch in between
+*/
+class InflatePool {
+  public:
+    InflatePool(int threads) : _entries(NULL), _count(0), _next(0), _batch(0), _busy(0), _stopping(false) {
+        for (int i = 1; i < threads; i++) {
+            _workers.emplace_back(&InflatePool::_worker_main, this);
+        }
+    }
+
+    ~InflatePool() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _batch_cv.notify_all();
+        for (auto &worker : _workers) {
+            worker.join();
+        }
+    }
+
+    // Returns once every entry is inflated
+    void run(entry_t *entries, size_t count) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _entries = entries;
+            _count = count;
+            _next = 0;
+            _batch++;
+            _busy = _workers.size();
+        }
+        _batch_cv.notify_all();
+        _work();
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done_cv.wait(lock, [this] { return 0 == _busy; });
+    }
+
+  private:
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _batch_cv, _done_cv;
+    entry_t *_entries;
+    size_t _count;
+    std::atomic<size_t> _next;
+    uint64_t _batch;
+    size_t _busy;
+    bool _stopping;
+
+    void _work() {
+        for (size_t i; (i = _next++) < _count;) {
+            inflate_entry(&_entries[i]);
+        }
+    }
+
+    void _worker_main() {
+        uint64_t batch = 0;
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _batch_cv.wait(lock, [&] { return _batch != batch || _stopping; });
+            if (_stopping) {
+                break;
+            }
+            batch = _batch;
+            lock.unlock();
+            _work();
+            lock.lock();
+            if (0 == --_busy) {
+                _done_cv.notify_one();
+            }
+        }
+    }
+};
+
+/*
+Walks the objects starting in data, which begins with the carry-over of
+an object continuing from the previous container, and leaves the
+incomplete last object in carry. Adds them to totals and meta.
+*/
+static void walk_objects(const uint8_t *data, size_t size, std::vector<uint8_t> *carry, totals_t *totals, blf_index_entry_t *meta) {
+    size_t pos = 0;
+    while (pos < size) {
+        obj_header_base_t base;
+        if (size - pos < sizeof(base)) {
+            break;
+        }
+        memcpy(&base, data + pos, sizeof(base));
+        if (memcmp(base.signature, "LOBJ", 4) || base.header_size < sizeof(base) || base.object_size < base.header_size) {
+            // the start of this container was lost with the previous one
+            pos = find_signature(data + pos + 1, data + size) - data;
+            continue;
+        }
+        if (base.object_size > size - pos) {
+            break;
+        }
+
+        uint64_t timestamp = 0;
+        if (base.header_size >= sizeof(obj_header_base_t) + sizeof(obj_header_v1_t)) {
+            uint32_t flags;
+            memcpy(&flags, data + pos + sizeof(base), sizeof(flags));
+            memcpy(&timestamp, data + pos + sizeof(base) + offsetof(obj_header_v1_t, timestamp), sizeof(timestamp));
+            if (flags & TIME_TEN_MICS) {
+                timestamp *= 10000;
+            }
+        }
+        totals->objects++;
+        totals->max_timestamp = std::max(totals->max_timestamp, timestamp);
+        if (meta) {
+            meta->min_timestamp = meta->count_of_objects ? std::min(meta->min_timestamp, timestamp) : timestamp;
+            meta->max_timestamp = meta->count_of_objects ? std::max(meta->max_timestamp, timestamp) : timestamp;
+            meta->count_of_objects++;
+            // the arbitration id follows channel, flags and dlc in every CAN message object
+            uint32_t type = base.object_type;
+            if ((CAN_MESSAGE == type || CAN_MESSAGE2 == type || CAN_FD_MESSAGE == type || CAN_FD_MESSAGE_64 == type) && base.object_size >= base.header_size + 8u) {
+                uint32_t id;
+                memcpy(&id, data + pos + base.header_size + 4, sizeof(id));
+                blf_id_filter_add(meta->id_filter, id & ~CAN_MSG_EXT);
+            }
+        }
+        pos += base.object_size + (CAN_FD_MESSAGE_64 == base.object_type ? 0 : base.object_size % 4);
+    }
+
+    if (pos < size) {
+        carry->assign(data + pos, data + size);
+    } else {
+        carry->clear();
+    }
+}
+
+static bool write_fully(int fd, const uint8_t *data, size_t size, uint64_t offset) {
+    while (size) {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+static systemtime_t add_ns(const systemtime_t &start, uint64_t ns) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = start.year - 1900;
+    tm.tm_mon = start.month - 1;
+    tm.tm_mday = start.day;
+    tm.tm_hour = start.hour;
+    tm.tm_min = start.minute;
+    tm.tm_sec = start.second;
+    uint64_t ms = (uint64_t)timegm(&tm) * 1000 + start.millisecond + ns / 1000000;
+    time_t seconds = ms / 1000;
+    gmtime_r(&seconds, &tm);
+
+    systemtime_t stop;
+    stop.year = tm.tm_year + 1900;
+    stop.month = tm.tm_mon + 1;
+    stop.isoweekday = tm.tm_wday;
+    stop.day = tm.tm_mday;
+    stop.hour = tm.tm_hour;
+    stop.minute = tm.tm_min;
+    stop.second = tm.tm_sec;
+    stop.millisecond = ms % 1000;
+    return stop;
+}
+
+static bool sync_and_close(int fd) {
+    bool ok = 0 == fsync(fd);
+    return 0 == close(fd) && ok;
+}
+
+// Makes a rename in the directory of path durable
+static void sync_directory(const char *path) {
+    const char *slash = strrchr(path, '/');
+    std::string dir = slash ? std::string(path, slash == path ? 1 : slash - path) : ".";
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+bool blf_repair(const char *filepath, const blf_repair_config_t &config, blf_repair_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    int threads = config.threads > 0 ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+    int fd = open(filepath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(filepath);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    if (st.st_size < FILE_HEADER_SIZE) {
+        fprintf(stderr, "%s: too short for a BLF file\n", filepath);
+        close(fd);
+        return false;
+    }
+    size_t map_size = st.st_size;
+    const uint8_t *map = (const uint8_t *)mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map) {
+        perror("mmap");
+        return false;
+    }
+    madvise((void *)map, map_size, MADV_SEQUENTIAL);
+
+    file_header_t header;
+    memcpy(&header, map, sizeof(header));
+    bool header_valid = 0 == memcmp(header.signature, "LOGG", 4) && header.header_size >= (uint32_t)FILE_HEADER_SIZE && header.header_size < map_size;
+    if (!header_valid) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.signature, "LOGG", 4);
+        header.header_size = FILE_HEADER_SIZE;
+        header.application_id = 5;
+        header.bin_log_major = 2;
+        header.bin_log_minor = 5;
+        header.bin_log_build = 8;
+        header.bin_log_patch = 1;
+    }
+
+    // the original is only replaced once the repaired copy is complete
+    std::string tmp_path = std::string(filepath) + ".tmp";
+    std::string index_path = std::string(filepath) + ".idx";
+    std::string tmp_index_path = index_path + ".tmp";
+    int out = -1;
+    FILE *index_fd = NULL;
+    bool ok = true;
+    if (!config.dry_run) {
+        out = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+        if (out < 0) {
+            perror(tmp_path.c_str());
+            munmap((void *)map, map_size);
+            return false;
+        }
+        // the rest of a longer header is kept as it was
+        std::vector<uint8_t> header_bytes(header.header_size, 0);
+        if (header_valid) {
+            memcpy(header_bytes.data(), map, header.header_size);
+        }
+        ok = write_fully(out, header_bytes.data(), header_bytes.size(), 0);
+        if (0 == access(index_path.c_str(), F_OK)) {
+            index_fd = fopen(tmp_index_path.c_str(), "wb");
+        }
+    }
+    blf_index_header_t index_header = {
+        .signature = {'B', 'L', 'F', 'I'},
+        .header_size = sizeof(blf_index_header_t),
+        .entry_size = sizeof(blf_index_entry_t),
+        .count_of_entries = 0,
+        .count_of_objects = 0,
+        .file_size = 0,
+    };
+    if (index_fd) {
+        fwrite(&index_header, sizeof(index_header), 1, index_fd);
+    }
+
+    totals_t totals;
+    memset(&totals, 0, sizeof(totals));
+    totals.uncompressed_size = FILE_HEADER_SIZE;
+    totals.file_size = header.header_size;
+    std::vector<entry_t> entries(BATCH_SIZE);
+    std::vector<uint8_t> carry, joined;
+    size_t pos = header.header_size;
+    InflatePool pool(threads);
+
+    while (ok && pos < map_size) {
+        size_t count = 0;
+        while (count < BATCH_SIZE && pos < map_size) {
+            entry_t *entry = &entries[count];
+            if (parse_entry(map, map_size, pos, entry)) {
+                pos += entry->size;
+                count++;
+                continue;
+            }
+            size_t next = find_signature(map + pos + 1, map + map_size) - map;
+            totals.skipped_bytes += next - pos;
+            pos = next;
+        }
+        pool.run(entries.data(), count);
+
+        for (size_t i = 0; ok && i < count; i++) {
+            entry_t *entry = &entries[i];
+            if (!entry->ok) {
+                fprintf(stderr, "dropping invalid container at offset %zu\n", entry->offset);
+                totals.dropped++;
+                carry.clear();
+                continue;
+            }
+
+            blf_index_entry_t meta;
+            memset(&meta, 0, sizeof(meta));
+            if (entry->is_container) {
+                const uint8_t *data = entry->data;
+                size_t size = std::min(entry->data_size, (size_t)entry->size_uncompressed);
+                if (!carry.empty()) {
+                    joined.assign(carry.begin(), carry.end());
+                    joined.insert(joined.end(), data, data + size);
+                    data = joined.data();
+                    size = joined.size();
+                }
+                walk_objects(data, size, &carry, &totals, &meta);
+                totals.containers++;
+                totals.uncompressed_size += sizeof(obj_header_base_t) + sizeof(log_container_t) + entry->size_uncompressed;
+            } else {
+                walk_objects(map + entry->offset, entry->object_size, &carry, &totals, NULL);
+                carry.clear();
+                totals.uncompressed_size += entry->object_size;
+            }
+
+            if (out >= 0) {
+                ok = write_fully(out, map + entry->offset, entry->size, totals.file_size);
+            }
+            if (index_fd && entry->is_container) {
+                meta.offset = totals.file_size;
+                meta.object_size = entry->object_size;
+                meta.uncompressed_size = entry->size_uncompressed;
+                fwrite(&meta, sizeof(meta), 1, index_fd);
+                index_header.count_of_entries++;
+            }
+            totals.file_size += entry->size;
+        }
+    }
+    for (auto &entry : entries) {
+        free(entry.buffer);
+    }
+    munmap((void *)map, map_size);
+
+    header.file_size = totals.file_size;
+    header.uncompressed_size = totals.uncompressed_size;
+    header.count_of_objects = totals.objects;
+    header.count_of_objects_read = 0;
+    if (header.time_start.year) {
+        header.time_stop = add_ns(header.time_start, totals.max_timestamp);
+    }
+
+    stats->containers = totals.containers;
+    stats->objects = totals.objects;
+    stats->dropped = totals.dropped;
+    stats->skipped_bytes = totals.skipped_bytes;
+    stats->old_size = map_size;
+    stats->new_size = totals.file_size;
+
+    if (out >= 0) {
+        ok = ok && write_fully(out, (const uint8_t *)&header, sizeof(header), 0);
+        ok = sync_and_close(out) && ok;
+        if (ok && 0 == rename(tmp_path.c_str(), filepath)) {
+            sync_directory(filepath);
+        } else {
+            perror(tmp_path.c_str());
+            unlink(tmp_path.c_str());
+            ok = false;
+        }
+    }
+    if (index_fd) {
+        index_header.count_of_objects = header.count_of_objects;
+        index_header.file_size = header.file_size;
+        fseek(index_fd, 0, SEEK_SET);
+        fwrite(&index_header, sizeof(index_header), 1, index_fd);
+        // an index left unrenamed no longer matches the repaired file and is ignored
+        bool index_ok = 0 == fflush(index_fd) && 0 == fsync(fileno(index_fd));
+        index_ok = 0 == fclose(index_fd) && index_ok;
+        if (!ok || !index_ok || rename(tmp_index_path.c_str(), index_path.c_str()) < 0) {
+            unlink(tmp_index_path.c_str());
+        }
+    }
+    return ok;
+}
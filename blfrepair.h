@@ -0,0 +1,34 @@
+#ifndef BLFREPAIR_H
+#define BLFREPAIR_H
+
+#include "blflogger.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    // Threads validating containers, 0 uses every core
+    int threads = 0;
+    // Only report what would be repaired, the file is left untouched
+    bool dry_run = false;
+} blf_repair_config_t;
+
+typedef struct {
+    uint32_t containers;
+    uint64_t objects;
+    // invalid containers dropped
+    uint32_t dropped;
+    // garbage between objects and the torn tail
+    uint64_t skipped_bytes;
+    uint64_t old_size, new_size;
+} blf_repair_stats_t;
+
+/*
+Repairs a BLF file left behind by a logger that did not shut down
+cleanly. Valid objects are copied to <filepath>.tmp, which then replaces
+the original, so the damaged file stays intact until the repaired one is
+complete. An existing sidecar index is rebuilt the same way. Returns
+false if the file could not be read or the repaired one not written.
+*/
+bool blf_repair(const char *filepath, const blf_repair_config_t &config, blf_repair_stats_t *stats);
+
+#endif //BLFREPAIR_H
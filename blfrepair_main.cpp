@@ -0,0 +1,48 @@
+/*
+Repairs a BLF file in place, see blf_repair()
+
+    blfrepair out.blf
+    blfrepair -n out.blf
+*/
+#include "blfrepair.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n] [-j threads] file.blf\n", prog);
+    fprintf(stderr, "  -n  only report what would be repaired\n");
+}
+
+int main(int argc, char **argv) {
+    blf_repair_config_t config;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "nj:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            config.dry_run = true;
+            break;
+        case 'j':
+            config.threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    blf_repair_stats_t stats;
+    bool ok = blf_repair(argv[optind], config, &stats);
+    if (0 == stats.old_size) {
+        return 1;
+    }
+    printf("%u containers, %llu objects, %u invalid containers dropped, %llu bytes skipped\n", stats.containers,
+           (unsigned long long)stats.objects, stats.dropped, (unsigned long long)stats.skipped_bytes);
+    printf("file size %llu -> %llu\n", (unsigned long long)stats.old_size, (unsigned long long)stats.new_size);
+    return ok ? 0 : 1;
+}
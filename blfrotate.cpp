@@ -0,0 +1,169 @@
+#include "blfrotate.h"
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+BLFRotatingWriter::BLFRotatingWriter(const blf_rotate_config_t &config) : _writer_config(config.writer),
+                                                                          _template(config.path_template),
+                                                                          _max_bytes(config.max_bytes),
+                                                                          _period_ns(config.max_seconds * 1000000000ull),
+                                                                          _current({NULL, "", 0, 0}),
+                                                                          _rotate_at(0),
+                                                                          _sequence(0),
+                                                                          _next({NULL, "", 0, 0}),
+                                                                          _stopping(false) {
+    _thread = std::thread(&BLFRotatingWriter::_thread_main, this);
+}
+
+BLFRotatingWriter::~BLFRotatingWriter() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_current.writer) {
+            _finishing.push_back(_current);
+            _current.writer = NULL;
+        }
+        _stopping = true;
+    }
+    _work_cv.notify_one();
+    _thread.join();
+
+    // opened ahead but never used
+    if (_next.writer) {
+        delete _next.writer;
+        unlink(_next.part_path.c_str());
+        if (_writer_config.write_index) {
+            unlink((_next.part_path + ".idx").c_str());
+        }
+    }
+}
+
+void BLFRotatingWriter::on_message_received(uint64_t timestamp_ns, uint32_t arbitration_id, uint8_t *data, uint8_t dlc) {
+    on_message_received(timestamp_ns, arbitration_id, data, dlc, 1, false, false, false, false, true, false, false);
+}
+
+void BLFRotatingWriter::on_message_received(uint64_t timestamp_ns, uint32_t arbitration_id, uint8_t *data, uint8_t dlc, uint16_t channel, bool is_extended_id, bool is_remote_frame, bool is_error_frame, bool is_fd, bool is_rx, bool bitrate_switch, bool error_state_indicator) {
+    if (_rotate_due(timestamp_ns)) {
+        _start_file(timestamp_ns);
+    }
+    _current.writer->on_message_received(timestamp_ns, arbitration_id, data, dlc, channel, is_extended_id, is_remote_frame, is_error_frame, is_fd, is_rx, bitrate_switch, error_state_indicator);
+}
+
+#ifdef __linux__
+void BLFRotatingWriter::write_batch(const blf_frame_t *frames, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        if (_rotate_due(frames[i].timestamp_ns)) {
+            _start_file(frames[i].timestamp_ns);
+        }
+        // the size is only checked between runs, the time for every frame
+        size_t end = i + 1;
+        while (end < n && frames[end].timestamp_ns < _rotate_at) {
+            end++;
+        }
+        _current.writer->write_batch(frames + i, end - i);
+        i = end;
+    }
+}
+#endif
+
+inline bool BLFRotatingWriter::_rotate_due(uint64_t timestamp_ns) {
+    return NULL == _current.writer || timestamp_ns >= _rotate_at || (_max_bytes && _current.writer->file_size() >= _max_bytes);
+}
+
+/*
+Hands the current file to the background thread and continues in the
+file it opened ahead. Only waits if that is not open yet.
+*/
+void BLFRotatingWriter::_start_file(uint64_t timestamp_ns) {
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_current.writer) {
+            _finishing.push_back(_current);
+        }
+        _next_cv.wait(lock, [this] { return NULL != _next.writer; });
+        _current = _next;
+        _next.writer = NULL;
+    }
+    _work_cv.notify_one();
+
+    _current.start_ns = timestamp_ns;
+    _sequence++;
+    _rotate_at = _period_ns ? (timestamp_ns / _period_ns + 1) * _period_ns : UINT64_MAX;
+}
+
+/*
+Opens the next file whenever the previous one was taken, and closes and
+renames finished files, until stopped with nothing left to finish
+*/
+void BLFRotatingWriter::_thread_main() {
+    uint32_t opened = 0;
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+        _work_cv.wait(lock, [this] { return !_finishing.empty() || (NULL == _next.writer && !_stopping) || _stopping; });
+        if (NULL == _next.writer && !_stopping) {
+            lock.unlock();
+            // the final name depends on the first frame, use the sequence
+            // number to keep the part file names apart
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            uint32_t sequence = ++opened;
+            std::string part_path = _expand(now.tv_sec * 1000000000ull, sequence) + "." + std::to_string(sequence) + ".part";
+            BLFWriter *writer = new BLFWriter(part_path.c_str(), _writer_config);
+            lock.lock();
+            _next = {writer, part_path, 0, sequence};
+            _next_cv.notify_one();
+            continue;
+        }
+        if (!_finishing.empty()) {
+            file_t file = _finishing.front();
+            _finishing.pop_front();
+            lock.unlock();
+            _finish(file);
+            lock.lock();
+            continue;
+        }
+        if (_stopping) {
+            break;
+        }
+    }
+}
+
+void BLFRotatingWriter::_finish(file_t &file) {
+    delete file.writer;
+    std::string path = _expand(file.start_ns, file.sequence);
+    if (rename(file.part_path.c_str(), path.c_str()) < 0) {
+        perror(path.c_str());
+    }
+    if (_writer_config.write_index) {
+        rename((file.part_path + ".idx").c_str(), (path + ".idx").c_str());
+    }
+}
+
+/*
+Expands the path template for a file starting at timestamp_ns
+*/
+std::string BLFRotatingWriter::_expand(uint64_t timestamp_ns, uint32_t sequence) {
+    std::string pattern;
+    for (const char *p = _template.c_str(); *p; p++) {
+        if ('%' == p[0] && 'N' == p[1]) {
+            char number[16];
+            snprintf(number, sizeof(number), "%04u", sequence);
+            pattern += number;
+            p++;
+        } else if ('%' == p[0] && p[1]) {
+            pattern += p[0];
+            pattern += *++p;
+        } else {
+            pattern += *p;
+        }
+    }
+
+    time_t seconds = timestamp_ns / 1000000000ull;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    char path[PATH_MAX];
+    size_t len = strftime(path, sizeof(path), pattern.c_str(), &tm);
+    return std::string(path, len);
+}
@@ -0,0 +1,79 @@
+#ifndef BLFROTATE_H
+#define BLFROTATE_H
+
+#include "blflogger.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+typedef struct {
+    blf_writer_config_t writer;
+    // strftime() pattern for the file names, expanded in UTC with the
+    // timestamp of the first frame in the file. %N expands to the file's
+    // sequence number.
+    const char *path_template = "%Y%m%d_%H%M%S_%N.blf";
+    // Start a new file once this many bytes are written, 0 disables
+    uint64_t max_bytes = 0;
+    // Start a new file at every multiple of this many seconds of frame
+    // time since the epoch, e.g. 600 rotates at :00, :10, ... 0 disables.
+    uint32_t max_seconds = 0;
+} blf_rotate_config_t;
+
+/*
+Logs into a sequence of BLF files, moving on to the next file by size or
+by frame time. The next file is opened ahead of time and finished files
+are closed, which compresses and writes their last container and
+header, on a background thread, so rotating only swaps writers on the
+logging thread. Files are written under a temporary .part name and
+renamed to their final name once complete.
+*/
+class BLFRotatingWriter {
+  public:
+    BLFRotatingWriter(const blf_rotate_config_t &config);
+    ~BLFRotatingWriter();
+    void on_message_received(uint64_t timestamp_ns, uint32_t arbitration_id, uint8_t *data, uint8_t dlc, uint16_t channel, bool is_extended_id, bool is_remote_frame, bool is_error_frame, bool is_fd, bool is_rx, bool bitrate_switch, bool error_state_indicator);
+    void on_message_received(uint64_t timestamp_ns, uint32_t arbitration_id, uint8_t *data, uint8_t dlc);
+#ifdef __linux__
+    void write_batch(const blf_frame_t *frames, size_t n);
+#endif
+    // Number of files started so far
+    uint32_t files() const { return _sequence; }
+
+  protected:
+    typedef struct {
+        BLFWriter *writer;
+        std::string part_path;
+        uint64_t start_ns;
+        uint32_t sequence;
+    } file_t;
+
+    const blf_writer_config_t _writer_config;
+    const std::string _template;
+    const uint64_t _max_bytes;
+    const uint64_t _period_ns;
+
+    // file being written, writer is NULL until the first frame
+    file_t _current;
+    uint64_t _rotate_at;
+    uint32_t _sequence;
+
+    // Opened ahead by the background thread, NULL while it is being opened
+    file_t _next;
+    std::deque<file_t> _finishing;
+    bool _stopping;
+    std::mutex _mutex;
+    std::condition_variable _work_cv, _next_cv;
+    std::thread _thread;
+
+    bool _rotate_due(uint64_t timestamp_ns);
+    void _start_file(uint64_t timestamp_ns);
+    void _thread_main();
+    std::string _expand(uint64_t timestamp_ns, uint32_t sequence);
+    void _finish(file_t &file);
+};
+
+#endif //BLFROTATE_H
@@ -0,0 +1,48 @@
+#ifndef BLFSTATIC_H
+#define BLFSTATIC_H
+
+#include "blflogger.h"
+#include "miniz/miniz.h"
+#include <algorithm>
+
+// mz_compressBound() at compile time
+static inline constexpr size_t blf_compress_bound(size_t size) {
+    return std::max(128 + size * 110 / 100, 128 + size + (size / (31 * 1024) + 1) * 5);
+}
+
+// Container buffer, deflate state and output of a BLFStaticWriter
+template <uint32_t ContainerSize, bool Compress>
+struct blf_static_storage_t {
+    uint8_t buffer[ContainerSize];
+    tdefl_compressor compressor;
+    uint8_t out[blf_compress_bound(ContainerSize)];
+
+    blf_writer_storage_t storage() { return {buffer, ContainerSize, &compressor, out, sizeof(out)}; }
+};
+
+template <uint32_t ContainerSize>
+struct blf_static_storage_t<ContainerSize, false> {
+    uint8_t buffer[ContainerSize];
+
+    blf_writer_storage_t storage() { return {buffer, ContainerSize, NULL, NULL, 0}; }
+};
+
+/*
+A BLFWriter carrying all of its memory inside the object, so a static or
+stack instance logs without ever touching the heap and its footprint is
+sizeof(BLFStaticWriter<...>). The deflate state alone is about 300 KiB
+with compression, less with miniz built with TDEFL_LESS_MEMORY. Build
+miniz with MINIZ_NO_MALLOC to rule out allocations inside it as well.
+
+    static BLFStaticWriter<8 * 1024> writer("/sdcard/log.blf");
+*/
+template <uint32_t ContainerSize = MAX_CONTAINER_SIZE, bool Compress = true>
+class BLFStaticWriter : private blf_static_storage_t<ContainerSize, Compress>, public BLFWriter {
+    static_assert(ContainerSize >= MIN_CONTAINER_SIZE && ContainerSize % 4 == 0, "containers must hold whole objects");
+
+  public:
+    // The storage base is constructed first, the writer only keeps pointers into it
+    BLFStaticWriter(const char *filepath, const blf_writer_config_t &config = blf_writer_config_t()) : BLFWriter(filepath, config, this->storage()) {}
+};
+
+#endif //BLFSTATIC_H
@@ -0,0 +1,290 @@
+/*
+Converts candump log files (candump -l) to BLF.
+
+The log is memory mapped and parsed in a single pass with table driven
+hex decoding; frames are collected into batches for
+BLFWriter::write_batch(). Interfaces are numbered as BLF channels in the
+order they first appear unless mapped explicitly with -m ifname=channel.
+
+Line format, see can-utils/lib.h:
+    (1436509052.249713) can0 123#DEADBEEF R
+    (1436509052.249713) can0 12345678##1AABBCCDD T
+*/
+#include "blflogger.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_INTERFACES 64
+#define BATCH_SIZE 1024
+
+typedef struct {
+    char name[IFNAMSIZ];
+    uint8_t len;
+    uint16_t channel;
+} interface_t;
+
+typedef struct {
+    interface_t interfaces[MAX_INTERFACES];
+    int count;
+    uint16_t next_channel;
+} channel_map_t;
+
+// hex digit value, or 0xFF for anything else
+static uint8_t hex_table[256];
+
+static void init_hex_table() {
+    memset(hex_table, 0xFF, sizeof(hex_table));
+    for (int c = '0'; c <= '9'; c++) hex_table[c] = c - '0';
+    for (int c = 'A'; c <= 'F'; c++) hex_table[c] = c - 'A' + 10;
+    for (int c = 'a'; c <= 'f'; c++) hex_table[c] = c - 'a' + 10;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-c level] [-C container_kib] [-q queue_depth] [-j threads] [-m ifname=channel]... input.log output.blf\n", prog);
+}
+
+static int add_interface(channel_map_t *map, const char *name, size_t len, uint16_t channel) {
+    if (map->count == MAX_INTERFACES || len >= IFNAMSIZ) {
+        return -1;
+    }
+    interface_t *itf = &map->interfaces[map->count++];
+    memcpy(itf->name, name, len);
+    itf->name[len] = 0;
+    itf->len = len;
+    itf->channel = channel;
+    if (channel >= map->next_channel) {
+        map->next_channel = channel + 1;
+    }
+    return itf->channel;
+}
+
+static int lookup_channel(channel_map_t *map, const char *name, size_t len) {
+    for (int i = 0; i < map->count; i++) {
+        if (map->interfaces[i].len == len && 0 == memcmp(map->interfaces[i].name, name, len)) {
+            return map->interfaces[i].channel;
+        }
+    }
+    return add_interface(map, name, len, map->next_channel);
+}
+
+/*
+Parses one line starting at p into f. Returns the start of the next line;
+*ok is cleared when the line is not a valid frame.
+*/
+static const char *parse_line(const char *p, const char *end, channel_map_t *map, blf_frame_t *f, bool *ok) {
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    const char *next = eol ? eol + 1 : end;
+    if (NULL == eol) {
+        eol = end;
+    }
+    *ok = false;
+
+    // (seconds.fraction)
+    if (p == eol || '(' != *p++) {
+        return next;
+    }
+    uint64_t sec = 0;
+    while (p < eol && (uint8_t)(*p - '0') < 10) {
+        sec = sec * 10 + (*p++ - '0');
+    }
+    uint64_t frac = 0, scale = 1000000000;
+    if (p < eol && '.' == *p) {
+        p++;
+        while (p < eol && (uint8_t)(*p - '0') < 10) {
+            if (scale > 1) {
+                scale /= 10;
+                frac += (*p - '0') * scale;
+            }
+            p++;
+        }
+    }
+    if (p + 1 >= eol || ')' != *p || ' ' != p[1]) {
+        return next;
+    }
+    p += 2;
+
+    // interface
+    const char *name = p;
+    while (p < eol && ' ' != *p) {
+        p++;
+    }
+    int channel = lookup_channel(map, name, p - name);
+    if (channel < 0 || p == eol) {
+        return next;
+    }
+    p++;
+
+    // can_id
+    const char *id_start = p;
+    canid_t can_id = 0;
+    uint8_t nibble;
+    while (p < eol && (nibble = hex_table[(uint8_t)*p]) < 16) {
+        can_id = (can_id << 4) | nibble;
+        p++;
+    }
+    if (p == eol || '#' != *p) {
+        return next;
+    }
+    if (8 == p - id_start) {
+        if (!(can_id & CAN_ERR_FLAG)) {
+            can_id |= CAN_EFF_FLAG;
+        }
+    } else if (3 != p - id_start) {
+        return next;
+    }
+    p++;
+
+    memset(&f->frame, 0, offsetof(struct canfd_frame, data));
+    uint8_t max_len = CAN_MAX_DLEN;
+    if (p < eol && ('R' == *p || 'r' == *p)) {
+        can_id |= CAN_RTR_FLAG;
+        p++;
+        if (p < eol && (nibble = hex_table[(uint8_t)*p]) <= CAN_MAX_DLEN) {
+            f->frame.len = nibble;
+            p++;
+        }
+    } else {
+        if (p < eol && '#' == *p) {
+            // CAN FD: ##<flags nibble><data>
+            if (p + 1 >= eol || (nibble = hex_table[(uint8_t)p[1]]) > 15) {
+                return next;
+            }
+            f->frame.flags = nibble | CANFD_FDF;
+            max_len = CANFD_MAX_DLEN;
+            p += 2;
+        }
+        uint8_t len = 0;
+        while (p + 1 < eol && len < max_len) {
+            if ('.' == *p) {
+                p++;
+                continue;
+            }
+            uint8_t hi = hex_table[(uint8_t)p[0]];
+            uint8_t lo = hex_table[(uint8_t)p[1]];
+            if ((hi | lo) > 15) {
+                break;
+            }
+            f->frame.data[len++] = (hi << 4) | lo;
+            p += 2;
+        }
+        f->frame.len = len;
+        // skip an optional _<raw dlc> suffix of classic frames
+        if (p < eol && '_' == *p) {
+            p += 2;
+        }
+    }
+    f->frame.can_id = can_id;
+
+    // optional direction
+    f->flags = 0;
+    if (p + 1 < eol && ' ' == *p && 'T' == p[1]) {
+        f->flags = BLF_FRAME_TX;
+    }
+
+    f->timestamp_ns = sec * 1000000000ull + frac;
+    f->channel = channel;
+    *ok = true;
+    return next;
+}
+
+int main(int argc, char **argv) {
+    blf_writer_config_t config;
+    config.queue_depth = 8;
+    channel_map_t map;
+    memset(&map, 0, sizeof(map));
+    map.next_channel = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:C:q:j:m:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            config.compression_level = atoi(optarg);
+            break;
+        case 'C':
+            config.container_size = atoi(optarg) * 1024;
+            break;
+        case 'q':
+            config.queue_depth = atoi(optarg);
+            break;
+        case 'j':
+            config.compression_threads = atoi(optarg);
+            break;
+        case 'm': {
+            const char *eq = strchr(optarg, '=');
+            if (NULL == eq || add_interface(&map, optarg, eq - optarg, atoi(eq + 1)) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    const char *data = NULL;
+    if (st.st_size > 0) {
+        data = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED == data) {
+            perror("mmap");
+            return 1;
+        }
+        madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    init_hex_table();
+    blf_frame_t *batch = (blf_frame_t *)malloc(BATCH_SIZE * sizeof(blf_frame_t));
+    uint64_t frames = 0, skipped = 0;
+    {
+        BLFWriter writer(argv[optind + 1], config);
+        const char *p = data, *end = data + st.st_size;
+        size_t n = 0;
+        while (p < end) {
+            bool ok;
+            p = parse_line(p, end, &map, &batch[n], &ok);
+            if (!ok) {
+                skipped++;
+                continue;
+            }
+            if (++n == BATCH_SIZE) {
+                writer.write_batch(batch, n);
+                frames += n;
+                n = 0;
+            }
+        }
+        writer.write_batch(batch, n);
+        frames += n;
+    }
+
+    fprintf(stderr, "%llu frames converted, %llu lines skipped\n", (unsigned long long)frames, (unsigned long long)skipped);
+    for (int i = 0; i < map.count; i++) {
+        fprintf(stderr, "  %s -> channel %u\n", map.interfaces[i].name, map.interfaces[i].channel);
+    }
+
+    free(batch);
+    if (data) {
+        munmap((void *)data, st.st_size);
+    }
+    close(fd);
+    return 0;
+}
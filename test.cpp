@@ -1,21 +1,827 @@
 #include "blflogger.h"
+#include "blfqueue.h"
+#include "blfreader.h"
+#include "blfrepair.h"
+#include "blfrotate.h"
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <net/if.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#endif
+#include <thread>
+#include <vector>
 
-int main() {
-    BLFWriter writer("foo.blf");
+static void read_back(uint8_t threads) {
+    uint8_t data[] = {0x12, 0x34, 0x56};
+    blf_reader_config_t config;
+    config.threads = threads;
+    BLFReader reader("foo.blf", config);
+    assert(reader.is_open());
+    assert(10000 == reader.header().count_of_objects);
+
+    blf_object_t obj;
+    int i = 0;
+    while (reader.next(&obj)) {
+        const can_msg_t *msg = blf_can_msg(obj);
+        assert(msg);
+        assert(0x123 == msg->arbitration_id);
+        assert(i == msg->channel);
+        assert((i % 2 ? 0 : CAN_MSG_FLAG_TX) == msg->flags);
+        assert(sizeof(data) == msg->dlc && 0 == memcmp(data, msg->data, sizeof(data)));
+        assert((uint64_t)i == blf_object_timestamp_ns(obj));
+        i++;
+    }
+    assert(10000 == i);
+}
+
+static void write_and_read_back(int8_t compression_level) {
+    uint8_t data[] = {0x12, 0x34, 0x56};
+    {
+        BLFWriter writer("foo.blf", compression_level);
+        for (int i = 0; i < 10000; i++) {
+            writer.on_message_received(12312 + i, 0x123, data, sizeof(data), i, false, false, false, false, i % 2, false, false);
+        }
+    }
+
+    read_back(0);
+    read_back(2);
+}
+
+static void container_size(uint32_t size) {
+    uint8_t data[] = {0x12, 0x34, 0x56};
+    {
+        blf_writer_config_t config;
+        config.container_size = size;
+        BLFWriter writer("foo.blf", config);
+        for (int i = 0; i < 10000; i++) {
+            writer.on_message_received(12312 + i, 0x123, data, sizeof(data), i, false, false, false, false, i % 2, false, false);
+        }
+    }
+
+    read_back(0);
+}
+
+// Containers compressed out of order must still be written in fill order
+static void compression_threads(uint8_t threads) {
+    uint8_t data[] = {0x12, 0x34, 0x56};
+    {
+        blf_writer_config_t config;
+        config.container_size = MIN_CONTAINER_SIZE;
+        config.queue_depth = 8;
+        config.compression_threads = threads;
+        BLFWriter writer("foo.blf", config);
+        for (int i = 0; i < 10000; i++) {
+            writer.on_message_received(12312 + i, 0x123, data, sizeof(data), i, false, false, false, false, i % 2, false, false);
+        }
+    }
+
+    read_back(0);
+}
+
+#ifdef __linux__
+// Falls back to synchronous writes without io_uring, which proves nothing here
+static bool io_uring_available() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, 4, &params);
+    if (fd < 0) {
+        printf("io_uring_setup: %s, skipping io_uring test\n", strerror(errno));
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+static void io_uring_write_and_read_back(uint8_t queue_depth) {
+    if (!io_uring_available()) {
+        return;
+    }
+    uint8_t data[] = {0x12, 0x34, 0x56};
+    {
+        blf_writer_config_t config;
+        config.container_size = MIN_CONTAINER_SIZE;
+        config.queue_depth = queue_depth;
+        config.io_uring_depth = 4;
+        BLFWriter writer("foo.blf", config);
+        for (int i = 0; i < 10000; i++) {
+            writer.on_message_received(12312 + i, 0x123, data, sizeof(data), i, false, false, false, false, i % 2, false, false);
+            if (5000 == i) {
+                // header rewritten while container writes are in flight
+                writer.sync();
+            }
+        }
+    }
+
+    read_back(0);
+}
+#endif
+
+/*
+O_DIRECT only writes whole blocks, count objects leave the file ending
+partway through one. Checkpointing at sync_at pads and rewrites the
+staged tail before more is appended to it.
+*/
+static void direct_io_write_and_read_back(int8_t compression_level, int count, int sync_at) {
+    uint8_t data[] = {0x12, 0x34, 0x56};
+    {
+        blf_writer_config_t config;
+        config.compression_level = compression_level;
+        config.direct_io = true;
+        BLFWriter writer("foo.blf", config);
+        for (int i = 0; i < count; i++) {
+            writer.on_message_received(12312 + i, 0x123, data, sizeof(data), i, false, false, false, false, i % 2, false, false);
+            if (sync_at == i) {
+                writer.sync();
+            }
+        }
+    }
+
+    BLFReader reader("foo.blf");
+    struct stat st;
+    assert(0 == stat("foo.blf", &st));
+    assert(reader.header().file_size == (uint64_t)st.st_size && st.st_size % 4096);
+    assert((uint32_t)count == reader.header().count_of_objects);
+    blf_object_t obj;
+    int i = 0;
+    while (reader.next(&obj)) {
+        const can_msg_t *msg = blf_can_msg(obj);
+        assert(msg && (uint16_t)i == msg->channel && 0 == memcmp(data, msg->data, sizeof(data)));
+        assert((uint64_t)i == blf_object_timestamp_ns(obj));
+        i++;
+    }
+    assert(count == i);
+    unlink("foo.blf");
+}
+
+static void fd_messages(bool fd_message_64) {
+    uint8_t data[64];
+    for (int i = 0; i < 64; i++) {
+        data[i] = i;
+    }
+    {
+        blf_writer_config_t config;
+        config.fd_message_64 = fd_message_64;
+        BLFWriter writer("foo.blf", config);
+        for (int i = 0; i <= 64; i++) {
+            writer.on_message_received(1 + i, 0x12345, data, i, 2, true, false, false, true, i % 2, i % 3 == 0, i % 5 == 0);
+        }
+    }
+
+    BLFReader reader("foo.blf");
+    blf_object_t obj;
+    uint8_t len = 0;
+    while (reader.next(&obj)) {
+        uint32_t id;
+        assert(blf_object_arbitration_id(obj, &id) && 0x12345 == id);
+        if (fd_message_64) {
+            const can_fd_msg_64_t *msg = blf_can_fd_msg_64(obj);
+            assert(msg && offsetof(can_fd_msg_64_t, data) + len == obj.size);
+            assert(2 == msg->channel && (len % 2 ? 0 : 1) == msg->dir);
+            assert(blf_len2dlc(len) == msg->dlc && len == msg->valid_bytes);
+            assert((CAN_FD_MSG_64_FLAG_EDL | (len % 3 ? 0 : CAN_FD_MSG_64_FLAG_BRS) | (len % 5 ? 0 : CAN_FD_MSG_64_FLAG_ESI)) == msg->flags);
+            assert(0 == memcmp(data, msg->data, len));
+        } else {
+            const can_fd_msg_t *msg = blf_can_fd_msg(obj);
+            assert(msg && 2 == msg->channel);
+            assert(blf_len2dlc(len) == msg->dlc && len == msg->valid_data_bytes);
+            assert((CAN_FD_MSG_FLAG_EDL | (len % 3 ? 0 : CAN_FD_MSG_FLAG_BRS) | (len % 5 ? 0 : CAN_FD_MSG_FLAG_ESI)) == msg->fd_flags);
+            assert(0 == memcmp(data, msg->data, len));
+        }
+        len++;
+    }
+    assert(65 == len);
+    unlink("foo.blf");
+}
+
+// Frames logged without a file to write to are dropped
+static void unopenable_path() {
+    uint8_t data[8] = {0};
+    BLFWriter writer("/nonexistent/foo.blf");
+    for (int i = 0; i < 100000; i++) {
+        writer.on_message_received(1 + 1000 * (uint64_t)i, 0x123, data, sizeof(data));
+    }
+}
+
+static void log_after_stop() {
+    uint8_t data[8] = {0};
+    {
+        BLFWriter writer("foo.blf");
+        for (int i = 0; i < 1000; i++) {
+            writer.on_message_received(1 + 1000 * (uint64_t)i, 0x123, data, sizeof(data));
+        }
+        writer.stop();
+        for (int i = 1000; i < 100000; i++) {
+            writer.on_message_received(1 + 1000 * (uint64_t)i, 0x123, data, sizeof(data));
+        }
+    }
+
+    BLFReader reader("foo.blf");
+    assert(1000 == reader.header().count_of_objects);
+    unlink("foo.blf");
+}
+
+static void earlier_than_first() {
+    uint8_t data[8] = {0};
+    {
+        BLFWriter writer("foo.blf");
+        writer.on_message_received(1000, 0x123, data, sizeof(data));
+        writer.on_message_received(500, 0x123, data, sizeof(data));
+    }
+
+    BLFReader reader("foo.blf");
+    blf_object_t obj;
+    assert(reader.next(&obj) && 0 == blf_object_timestamp_ns(obj));
+    assert(reader.next(&obj) && 0 == blf_object_timestamp_ns(obj));
+    assert(!reader.next(&obj));
+    unlink("foo.blf");
+}
+
+static void seek_with_index() {
+    uint8_t data[8] = {0};
+    {
+        blf_writer_config_t config;
+        config.write_index = true;
+        BLFWriter writer("foo.blf", config);
+        for (int i = 0; i < 100000; i++) {
+            writer.on_message_received(1000 * (uint64_t)i, 0x123, data, sizeof(data));
+        }
+    }
+
+    BLFReader reader("foo.blf");
+    assert(reader.seek_time(50000000, 50999999));
+    blf_object_t obj;
+    int count = 0;
+    while (reader.next(&obj)) {
+        assert(50000000 <= obj.timestamp && obj.timestamp <= 50999999);
+        count++;
+    }
+    assert(1000 == count);
+    unlink("foo.blf.idx");
+}
+
+// Message ids differ with and without index, so the containers do too
+static void write_indexed(bool write_index) {
+    uint8_t data[8] = {0};
+    blf_writer_config_t config;
+    config.write_index = write_index;
+    BLFWriter writer("foo.blf", config);
+    for (int i = 0; i < 100000; i++) {
+        writer.on_message_received(1 + 1000 * (uint64_t)i, 0x123 + write_index, data, sizeof(data));
+    }
+}
+
+static int count_in_range(bool index_used, uint32_t id) {
+    BLFReader reader("foo.blf");
+    assert(index_used == reader.seek_time(50000000, 50999999));
+    blf_object_t obj;
+    int count = 0;
+    while (reader.next(&obj)) {
+        assert(id == blf_can_msg(obj)->arbitration_id);
+        count++;
+    }
+    return count;
+}
+
+// An index written for an earlier file of the same name must not be used
+static void stale_index() {
+    write_indexed(true);
+    // the index of the first file is left in place
+    write_indexed(false);
+    assert(1000 == count_in_range(false, 0x123));
+    unlink("foo.blf.idx");
+}
+
+// An index that cannot be created leaves the log itself intact
+static void unwritable_index() {
+    assert(0 == mkdir("foo.blf.idx", 0755));
+    write_indexed(true);
+    assert(1000 == count_in_range(false, 0x124));
+    rmdir("foo.blf.idx");
+    unlink("foo.blf");
+}
+
+static void filter_ids_with_index() {
+    uint8_t data[8] = {0};
+    {
+        blf_writer_config_t config;
+        config.write_index = true;
+        BLFWriter writer("foo.blf", config);
+        for (int i = 0; i < 100000; i++) {
+            bool rare = 0 == i % 10000;
+            writer.on_message_received(1000 * (uint64_t)i, rare ? 0x18FEF100 : 0x100 + i % 200, data, sizeof(data), 1, rare, false, false, false, true, false, false);
+        }
+    }
+
+    BLFReader reader("foo.blf");
+    uint32_t ids[] = {0x18FEF100, 0x7FF};
+    assert(reader.filter_ids(ids, 2));
+    blf_object_t obj;
+    int count = 0;
+    while (reader.next(&obj)) {
+        assert((0x18FEF100 | CAN_MSG_EXT) == blf_can_msg(obj)->arbitration_id);
+        count++;
+    }
+    assert(10 == count);
+    unlink("foo.blf.idx");
+}
+
+static void sync_checkpoints_header() {
+    uint8_t data[8] = {0};
+    blf_writer_config_t config;
+    config.queue_depth = 2;
+    BLFWriter writer("foo.blf", config);
+    for (int i = 0; i < 1000; i++) {
+        writer.on_message_received(1000 * (uint64_t)i, 0x123, data, sizeof(data));
+    }
+    writer.sync();
+
+    BLFReader reader("foo.blf");
+    struct stat st;
+    assert(0 == stat("foo.blf", &st));
+    assert(1000 == reader.header().count_of_objects);
+    assert(reader.header().file_size == (uint64_t)st.st_size);
+    assert(1 == writer.stats().checkpoints);
+}
+
+// File size after each container, from the trace hook
+static void track_file_size(void *ctx, blf_trace_event_t event, uint64_t, uint64_t b) {
+    std::vector<uint64_t> *sizes = (std::vector<uint64_t> *)ctx;
+    if (BLF_TRACE_CONTAINER == event) {
+        uint64_t obj_size = sizeof(obj_header_base_t) + sizeof(log_container_t) + b;
+        sizes->push_back((sizes->empty() ? FILE_HEADER_SIZE : sizes->back()) + obj_size + obj_size % 4);
+    }
+}
+
+static void checkpoint_every_containers() {
+    uint8_t data[8] = {0};
+    blf_writer_config_t config;
+    config.container_size = MIN_CONTAINER_SIZE;
+    config.checkpoint_containers = 4;
+    std::vector<uint64_t> sizes;
+    BLFWriter writer("foo.blf", config);
+    writer.set_trace_hook(track_file_size, &sizes);
+    for (int i = 0; i < 1000; i++) {
+        writer.on_message_received(1 + 1000 * (uint64_t)i, 0x123, data, sizeof(data));
+    }
+
+    // the header points at the end of the last checkpointed container
+    size_t checkpointed = sizes.size() / 4 * 4;
+    assert(checkpointed >= 8);
+    assert(checkpointed / 4 == writer.stats().checkpoints);
+    BLFReader reader("foo.blf");
+    assert(sizes[checkpointed - 1] == reader.header().file_size);
+    assert(checkpointed * (MIN_CONTAINER_SIZE / 48) == reader.header().count_of_objects);
+    writer.stop();
+    unlink("foo.blf");
+}
+
+static void checkpoint_every_ms() {
+    uint8_t data[8] = {0};
+    blf_writer_config_t config;
+    config.container_size = MIN_CONTAINER_SIZE;
+    config.checkpoint_ms = 50;
+    BLFWriter writer("foo.blf", config);
+    for (int i = 0; i < 100; i++) {
+        writer.on_message_received(1 + 1000 * (uint64_t)i, 0x123, data, sizeof(data));
+    }
+    assert(0 == writer.stats().checkpoints);
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    for (int i = 100; 0 == writer.stats().checkpoints; i++) {
+        // the timer closes the container at the next frame, at the latest
+        // once it has fired
+        assert(i < 100 + MIN_CONTAINER_SIZE / 48 + 1);
+        writer.on_message_received(1 + 1000 * (uint64_t)i, 0x123, data, sizeof(data));
+    }
 
-    frameobject_t fobj;
-    fobj.frame.timestamp = 12312;
-    fobj.frame.id = 0x123;
-    fobj.frame.length = 3;
-    fobj.frame.data.byte[0] = 0x12;
-    fobj.frame.data.byte[1] = 0x34;
-    fobj.frame.data.byte[2] = 0x56;
+    BLFReader reader("foo.blf");
+    struct stat st;
+    assert(0 == stat("foo.blf", &st));
+    assert(reader.header().file_size == (uint64_t)st.st_size);
+    writer.stop();
+    unlink("foo.blf");
+}
 
-    for (int i = 0; i < 10000; i++) {
-        fobj.bus_number = i;
-        fobj.direction = (i % 2 ? FRAME_DIRECTION_RX : FRAME_DIRECTION_TX);
-        writer.log(fobj);
+// Far fewer frames than fill a container still get checkpointed
+static void checkpoint_slow_bus(uint8_t queue_depth) {
+    uint8_t data[8] = {0};
+    blf_writer_config_t config;
+    config.queue_depth = queue_depth;
+    config.checkpoint_ms = 20;
+    BLFWriter writer("foo.blf", config);
+    for (int i = 0; i < 10; i++) {
+        writer.on_message_received(1 + 1000 * (uint64_t)i, 0x123, data, sizeof(data));
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    for (int i = 0; i < 100 && writer.stats().checkpoints < 2; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
+    assert(writer.stats().checkpoints >= 2);
+
+    BLFReader reader("foo.blf");
+    struct stat st;
+    assert(0 == stat("foo.blf", &st));
+    assert(reader.header().file_size == (uint64_t)st.st_size);
+    assert(reader.header().count_of_objects > 0);
     writer.stop();
+    unlink("foo.blf");
+}
+
+// A torn tail and a corrupt container are cut out, everything else is kept
+static void repair_damaged_file() {
+    uint8_t data[8] = {0};
+    {
+        blf_writer_config_t config;
+        config.container_size = MIN_CONTAINER_SIZE;
+        config.write_index = true;
+        BLFWriter writer("foo.blf", config);
+        for (int i = 0; i < 10000; i++) {
+            writer.on_message_received(1 + 1000 * (uint64_t)i, 0x123, data, sizeof(data), i, false, false, false, false, true, false, false);
+        }
+    }
+
+    // 21 objects per container, 4 in the last one
+    struct stat st;
+    assert(0 == stat("foo.blf", &st));
+    FILE *f = fopen("foo.blf", "r+b");
+    uint64_t offset = FILE_HEADER_SIZE;
+    for (int i = 0; i < 100; i++) {
+        obj_header_base_t base;
+        fseek(f, offset, SEEK_SET);
+        assert(1 == fread(&base, sizeof(base), 1, f));
+        offset += base.object_size + base.object_size % 4;
+    }
+    uint8_t garbage[16];
+    memset(garbage, 0xA5, sizeof(garbage));
+    fseek(f, offset + sizeof(obj_header_base_t) + sizeof(log_container_t) + 8, SEEK_SET);
+    fwrite(garbage, sizeof(garbage), 1, f);
+    fclose(f);
+    assert(0 == truncate("foo.blf", st.st_size - 10));
+
+    blf_repair_config_t config;
+    config.threads = 4;
+    blf_repair_stats_t stats;
+    assert(blf_repair("foo.blf", config, &stats));
+    assert(1 == stats.dropped && 10000 - 21 - 4 == stats.objects);
+    assert(stat("foo.blf.tmp", &st) < 0 && stat("foo.blf.idx.tmp", &st) < 0);
+
+    BLFReader reader("foo.blf");
+    assert(0 == stat("foo.blf", &st));
+    assert(reader.header().file_size == (uint64_t)st.st_size && stats.new_size == (uint64_t)st.st_size);
+    assert(10000 - 21 - 4 == reader.header().count_of_objects);
+    blf_object_t obj;
+    int i = 0;
+    while (reader.next(&obj)) {
+        if (100 * 21 == i) {
+            i += 21;
+        }
+        const can_msg_t *msg = blf_can_msg(obj);
+        assert(msg && (uint16_t)i == msg->channel);
+        assert(1000 * (uint64_t)i == blf_object_timestamp_ns(obj));
+        i++;
+    }
+    assert(10000 - 4 == i);
+    // the rebuilt index matches the repaired file
+    assert(reader.seek_time(0, 1000 * 99 * 21));
+    unlink("foo.blf");
+    unlink("foo.blf.idx");
+}
+
+static void rotate_by_time() {
+    uint8_t data[8] = {0};
+    {
+        blf_rotate_config_t config;
+        config.path_template = "foo_%N.blf";
+        config.max_seconds = 1;
+        BLFRotatingWriter writer(config);
+        for (int i = 0; i < 3000; i++) {
+            writer.on_message_received(1000000 * (uint64_t)i, 0x123, data, sizeof(data));
+        }
+        assert(3 == writer.files());
+    }
+
+    const char *paths[] = {"foo_0001.blf", "foo_0002.blf", "foo_0003.blf"};
+    for (int i = 0; i < 3; i++) {
+        BLFReader reader(paths[i]);
+        assert(reader.is_open());
+        assert(1000 == reader.header().count_of_objects);
+        unlink(paths[i]);
+    }
+}
+
+#ifdef __linux__
+static void concurrent_producers() {
+    {
+        blf_concurrent_config_t config;
+        config.capacity = 1024;
+        BLFConcurrentWriter writer("foo.blf", config);
+        std::vector<std::thread> producers;
+        for (uint16_t p = 0; p < 4; p++) {
+            producers.emplace_back([&writer, p] {
+                blf_frame_t f;
+                memset(&f, 0, sizeof(f));
+                f.channel = p;
+                f.frame.len = 4;
+                for (uint32_t i = 0; i < 10000; i++) {
+                    f.timestamp_ns = i;
+                    f.frame.can_id = CAN_EFF_FLAG | i;
+                    writer.push(f);
+                }
+            });
+        }
+        for (auto &t : producers) {
+            t.join();
+        }
+        assert(0 == writer.dropped());
+    }
+
+    BLFReader reader("foo.blf");
+    assert(40000 == reader.header().count_of_objects);
+    // interleaved, but each producer's frames in order
+    uint32_t next[4] = {0};
+    blf_object_t obj;
+    while (reader.next(&obj)) {
+        const can_msg_t *msg = blf_can_msg(obj);
+        assert(msg && msg->channel < 4);
+        assert(next[msg->channel]++ == (msg->arbitration_id & ~CAN_MSG_EXT));
+    }
+    for (int p = 0; p < 4; p++) {
+        assert(10000 == next[p]);
+    }
+    unlink("foo.blf");
+}
+
+// Sums up object sizes in bytes[0] and container contents in bytes[1]
+static void sum_object_sizes(void *ctx, blf_trace_event_t event, uint64_t a, uint64_t b) {
+    uint64_t *bytes = (uint64_t *)ctx;
+    if (BLF_TRACE_OBJECT == event) {
+        bytes[0] += b;
+    } else if (BLF_TRACE_CONTAINER == event) {
+        bytes[1] += a;
+    }
+}
+
+static std::vector<uint8_t> read_file(const char *path) {
+    std::vector<uint8_t> contents;
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        contents.insert(contents.end(), buffer, buffer + n);
+    }
+    fclose(f);
+    return contents;
+}
+
+// write_batch() must produce the very same file as logging frame by frame
+static void batch_matches_messages() {
+    static const uint8_t fd_lens[] = {0, 5, 8, 12, 16, 20, 24, 32, 48, 64};
+    std::vector<blf_frame_t> frames(3000);
+    for (uint32_t i = 0; i < frames.size(); i++) {
+        blf_frame_t &f = frames[i];
+        memset(&f, 0, sizeof(f));
+        // the last frame of every batch is not its newest, as with batches
+        // drained from several producers
+        f.timestamp_ns = 1 + 1000000 * (99 == i % 100 ? i - 50 : i);
+        f.channel = 1 + i % 2;
+        f.flags = i % 3 ? 0 : BLF_FRAME_TX;
+        f.frame.can_id = i % 4 ? 0x100 + i % 0x700 : CAN_EFF_FLAG | (0x18FE0000 + i);
+        if (i % 5) {
+            f.frame.len = i % 9;
+        } else {
+            f.frame.flags = CANFD_FDF | (i % 2 ? CANFD_BRS : 0);
+            f.frame.len = fd_lens[i / 5 % 10];
+        }
+        for (uint8_t j = 0; j < f.frame.len; j++) {
+            f.frame.data[j] = i + j;
+        }
+    }
+
+    uint64_t message_bytes[2] = {0}, batch_bytes[2] = {0};
+    {
+        BLFWriter writer("foo.blf");
+        writer.set_trace_hook(sum_object_sizes, message_bytes);
+        for (blf_frame_t &f : frames) {
+            bool is_extended_id = f.frame.can_id & CAN_EFF_FLAG;
+            writer.on_message_received(f.timestamp_ns, f.frame.can_id & (is_extended_id ? CAN_EFF_MASK : CAN_SFF_MASK), f.frame.data, f.frame.len, f.channel,
+                                       is_extended_id, false, false, f.frame.flags & CANFD_FDF, !(f.flags & BLF_FRAME_TX), f.frame.flags & CANFD_BRS, false);
+        }
+    }
+    {
+        BLFWriter writer("bar.blf");
+        writer.set_trace_hook(sum_object_sizes, batch_bytes);
+        for (size_t i = 0; i < frames.size(); i += 100) {
+            writer.write_batch(&frames[i], 100);
+        }
+    }
+
+    assert(read_file("foo.blf") == read_file("bar.blf"));
+    // one event per object carrying its size
+    assert(message_bytes[0] == message_bytes[1]);
+    assert(batch_bytes[0] == batch_bytes[1]);
+    unlink("foo.blf");
+    unlink("bar.blf");
+}
+
+static void merge_sources() {
+    {
+        blf_merging_config_t config;
+        config.sources = 3;
+        // room for every frame of a source, a full ring would release
+        // frames before the slower producers have pushed theirs
+        config.capacity = 16384;
+        config.reorder_window_ns = 1000000000;
+        BLFMergingWriter writer("foo.blf", config);
+        std::vector<std::thread> producers;
+        for (uint16_t p = 0; p < 3; p++) {
+            producers.emplace_back([&writer, p] {
+                blf_frame_t f;
+                memset(&f, 0, sizeof(f));
+                f.channel = p;
+                for (uint32_t i = 0; i < 10000; i++) {
+                    f.timestamp_ns = 1 + 3 * i + p;
+                    writer.push(p, f);
+                }
+            });
+        }
+        for (auto &t : producers) {
+            t.join();
+        }
+        assert(0 == writer.late());
+    }
+
+    BLFReader reader("foo.blf");
+    assert(30000 == reader.header().count_of_objects);
+    uint64_t i = 0;
+    blf_object_t obj;
+    while (reader.next(&obj)) {
+        assert(i++ == blf_object_timestamp_ns(obj));
+    }
+    assert(30000 == i);
+    unlink("foo.blf");
+}
+
+static void merge_late_source() {
+    {
+        blf_merging_config_t config;
+        config.sources = 2;
+        config.reorder_window_ns = 1000;
+        BLFMergingWriter writer("foo.blf", config);
+        blf_frame_t f;
+        memset(&f, 0, sizeof(f));
+        for (uint64_t ts : {1000, 2000, 10000}) {
+            f.timestamp_ns = ts;
+            writer.push(0, f);
+        }
+        // 1000 and 2000 are written, 10000 is held for source 1
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        f.timestamp_ns = 500;
+        writer.push(1, f);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        assert(1 == writer.late());
+    }
+
+    BLFReader reader("foo.blf");
+    uint64_t expected[] = {0, 1000, 0, 9000};
+    blf_object_t obj;
+    for (uint64_t ts : expected) {
+        assert(reader.next(&obj) && ts == blf_object_timestamp_ns(obj));
+    }
+    assert(!reader.next(&obj));
+    unlink("foo.blf");
+}
+
+static void merge_full_ring() {
+    {
+        blf_merging_config_t config;
+        config.sources = 2;
+        config.capacity = 4;
+        config.reorder_window_ns = 1000000000;
+        BLFMergingWriter writer("foo.blf", config);
+        blf_frame_t f;
+        memset(&f, 0, sizeof(f));
+        // source 1 stays quiet, this would block forever without the full ring rule
+        for (uint32_t i = 0; i < 1000; i++) {
+            f.timestamp_ns = 1 + i;
+            assert(writer.push(0, f));
+        }
+        assert(0 == writer.dropped());
+    }
+
+    BLFReader reader("foo.blf");
+    assert(1000 == reader.header().count_of_objects);
+    unlink("foo.blf");
+}
+
+// Needs vcan0 and vcan1, e.g. ip link add dev vcan0 type vcan && ip link set up vcan0
+static void capture_vcan() {
+    if (0 == if_nametoindex("vcan0") || 0 == if_nametoindex("vcan1")) {
+        printf("no vcan0 and vcan1, skipping blfcapture test\n");
+        return;
+    }
+    if (access("./blfcapture", X_OK) < 0) {
+        printf("no blfcapture next to the test, skipping blfcapture test\n");
+        return;
+    }
+    pid_t pid = fork();
+    if (0 == pid) {
+        execl("./blfcapture", "blfcapture", "-o", "foo.blf", "vcan0=1", "vcan1=2", (char *)NULL);
+        _exit(127);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    int socks[2];
+    const char *names[2] = {"vcan0", "vcan1"};
+    for (int i = 0; i < 2; i++) {
+        socks[i] = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+        struct sockaddr_can addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.can_family = AF_CAN;
+        addr.can_ifindex = if_nametoindex(names[i]);
+        assert(0 == bind(socks[i], (struct sockaddr *)&addr, sizeof(addr)));
+    }
+    // alternate between the interfaces, so a capture draining one
+    // interface before the other writes them out of order
+    struct can_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_dlc = 8;
+    for (uint32_t i = 0; i < 10000; i++) {
+        frame.can_id = i & CAN_SFF_MASK;
+        while (write(socks[i % 2], &frame, sizeof(frame)) < 0) {
+            assert(ENOBUFS == errno);
+            std::this_thread::yield();
+        }
+    }
+    close(socks[0]);
+    close(socks[1]);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    kill(pid, SIGINT);
+    int status;
+    assert(pid == waitpid(pid, &status, 0));
+    assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+    BLFReader reader("foo.blf");
+    uint64_t last = 0, frames[2] = {0, 0};
+    blf_object_t obj;
+    while (reader.next(&obj)) {
+        const can_msg_t *msg = blf_can_msg(obj);
+        assert(msg && msg->channel >= 1 && msg->channel <= 2);
+        frames[msg->channel - 1]++;
+        assert(blf_object_timestamp_ns(obj) >= last);
+        last = blf_object_timestamp_ns(obj);
+    }
+    assert(5000 == frames[0] && 5000 == frames[1]);
+    unlink("foo.blf");
+}
+#endif
+
+int main() {
+    write_and_read_back(-1);
+    write_and_read_back(0);
+    container_size(MIN_CONTAINER_SIZE);
+    container_size(256 * 1024);
+    compression_threads(1);
+    compression_threads(4);
+    direct_io_write_and_read_back(-1, 10, -1);
+    direct_io_write_and_read_back(0, 10, 5);
+    direct_io_write_and_read_back(0, 3001, -1);
+    direct_io_write_and_read_back(0, 10001, 4000);
+    direct_io_write_and_read_back(-1, 100001, 50000);
+#ifdef __linux__
+    io_uring_write_and_read_back(0);
+    io_uring_write_and_read_back(4);
+#endif
+    fd_messages(true);
+    fd_messages(false);
+    unopenable_path();
+    log_after_stop();
+    earlier_than_first();
+    seek_with_index();
+    filter_ids_with_index();
+    stale_index();
+    unwritable_index();
+    sync_checkpoints_header();
+    checkpoint_every_containers();
+    checkpoint_every_ms();
+    checkpoint_slow_bus(0);
+    checkpoint_slow_bus(2);
+    repair_damaged_file();
+    rotate_by_time();
+#ifdef __linux__
+    batch_matches_messages();
+    concurrent_producers();
+    merge_sources();
+    merge_late_source();
+    merge_full_ring();
+    capture_vcan();
+#endif
+    printf("ok\n");
     return 0;
 }
@@ -0,0 +1,83 @@
+#include "blfstatic.h"
+#include "blfreader.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every allocation fails while fail_allocations is set, glibc lets the
+// program replace malloc and friends
+static bool fail_allocations = false;
+static int allocations = 0;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    if (fail_allocations) {
+        allocations++;
+        return NULL;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (fail_allocations) {
+        allocations++;
+        return NULL;
+    }
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (fail_allocations) {
+        allocations++;
+        return NULL;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+}
+
+template <bool Compress>
+static void write_without_heap() {
+    uint8_t data[] = {0x12, 0x34, 0x56};
+    fail_allocations = true;
+    {
+        BLFStaticWriter<4096, Compress> writer("foo.blf");
+        for (int i = 0; i < 10000; i++) {
+            writer.on_message_received(i, 0x123, data, sizeof(data));
+            if (5000 == i) {
+                writer.sync();
+            }
+        }
+    }
+    fail_allocations = false;
+    assert(0 == allocations);
+
+    BLFReader reader("foo.blf");
+    assert(reader.is_open());
+    assert(10000 == reader.header().count_of_objects);
+    blf_object_t obj;
+    int i = 0;
+    while (reader.next(&obj)) {
+        const can_msg_t *msg = blf_can_msg(obj);
+        assert(msg && 0x123 == msg->arbitration_id);
+        assert(sizeof(data) == msg->dlc && 0 == memcmp(data, msg->data, sizeof(data)));
+        i++;
+    }
+    assert(10000 == i);
+    unlink("foo.blf");
+}
+
+int main() {
+    write_without_heap<true>();
+    write_without_heap<false>();
+    printf("ok\n");
+    return 0;
+}